@@ -0,0 +1,27 @@
+#include "BinaryFile.hpp"
+
+#include <algorithm>
+
+uint64_t alignOffset(uint64_t offset) {
+  return (offset + binaryFileAlignment - 1) / binaryFileAlignment * binaryFileAlignment;
+}
+
+bool isSectionValid(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t fileSize) {
+  return offset % binaryFileAlignment == 0 && offset <= fileSize && count <= (fileSize - offset) / elementSize;
+}
+
+BinaryFileWriter::BinaryFileWriter(std::ostream& stream) : _stream(stream) {
+}
+
+void BinaryFileWriter::writeSection(uint64_t offset, const void* data, uint64_t size) {
+  const char padding[binaryFileAlignment] = {};
+
+  while (_written < offset) {
+    auto gap = std::min(offset - _written, (uint64_t)sizeof(padding));
+    _stream.write(padding, gap);
+    _written += gap;
+  }
+
+  _stream.write((const char*)data, size);
+  _written = offset + size;
+}
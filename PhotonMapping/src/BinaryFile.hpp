@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+/// Offset alignment of every array in the binary files written by the program, enough for any SIMD load once the
+/// file is mapped with MappedFile
+constexpr uint64_t binaryFileAlignment = 64;
+
+/// Rounds the offset up to binaryFileAlignment
+uint64_t alignOffset(uint64_t offset);
+
+/// Checks that an array of count elements of the size given at the offset is aligned and inside the file. Each check
+/// is done against the remaining size so corrupted counts can not overflow the sums
+/// - Parameters:
+///   - offset: position of the array from the start of the file
+///   - count: number of elements of the array
+///   - elementSize: size of each element in bytes
+///   - fileSize: size of the whole file in bytes
+bool isSectionValid(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t fileSize);
+
+/// Writes a binary file as consecutive sections, filling the gaps between them with zeros so every section starts at
+/// the offset recorded for it in the header
+class BinaryFileWriter {
+public:
+  /// - Parameter stream: stream opened in binary mode at the start of the file
+  explicit BinaryFileWriter(std::ostream& stream);
+
+  /// Writes size bytes of data at the offset, which must not be before the end of the previous section
+  /// - Parameters:
+  ///   - offset: position of the section from the start of the file
+  ///   - data: bytes of the section
+  ///   - size: number of bytes
+  void writeSection(uint64_t offset, const void* data, uint64_t size);
+
+private:
+  std::ostream& _stream;
+  uint64_t _written = 0;
+};
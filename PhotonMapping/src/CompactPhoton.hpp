@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "PhotonHit.hpp"
+
+/// Photon record without position in 12 bytes, used when the photon maps are stored compressed (a PhotonHit takes
+/// 52). The position is kept by the tree nodes, so it is not repeated here.
+struct CompactPhoton {
+  /// Power in RGBE, three 8 bit mantissas sharing an 8 bit exponent (Ward, Graphics Gems II)
+  uint32_t power;
+  /// Octahedral encoded unit vectors, 8 bits per coordinate
+  uint16_t incidentDirection;
+  uint16_t normal;
+  uint16_t depth;
+};
+
+/// Compact photon together with its position, used while the photons are collected before building the tree
+struct CompactPhotonHit {
+  glm::vec3 position;
+  CompactPhoton photon;
+};
+
+inline uint32_t encodeRGBE(glm::vec3 color) {
+  auto maxColor = std::max(color.r, std::max(color.g, color.b));
+
+  if (!(maxColor > 1e-32f)) {
+    return 0;
+  }
+
+  int exponent;
+  std::frexp(maxColor, &exponent);
+  auto scale = std::ldexp(1.f, 8 - exponent);
+  auto mantissa = glm::clamp(glm::round(glm::max(color, 0.f) * scale), 0.f, 255.f);
+
+  return (uint32_t)mantissa.r | ((uint32_t)mantissa.g << 8) | ((uint32_t)mantissa.b << 16) |
+    ((uint32_t)(exponent + 128) << 24);
+}
+
+inline glm::vec3 decodeRGBE(uint32_t rgbe) {
+  auto exponent = (int)(rgbe >> 24);
+
+  if (exponent == 0) {
+    return glm::vec3{ 0.f };
+  }
+
+  auto scale = std::ldexp(1.f, exponent - (128 + 8));
+  return glm::vec3{ (float)(rgbe & 0xff), (float)((rgbe >> 8) & 0xff), (float)((rgbe >> 16) & 0xff) } * scale;
+}
+
+/// Maps a unit vector to the octahedron unfolded on a square (Cigolle et al., "A Survey of Efficient Representations
+/// for Independent Unit Vectors") and quantizes it to 8 bits per coordinate
+inline uint16_t encodeOctahedral(glm::vec3 vector) {
+  vector /= std::abs(vector.x) + std::abs(vector.y) + std::abs(vector.z);
+  glm::vec2 square{ vector.x, vector.y };
+
+  if (vector.z < 0.f) {
+    square = glm::vec2{
+      (1.f - std::abs(vector.y)) * (vector.x >= 0.f ? 1.f : -1.f),
+      (1.f - std::abs(vector.x)) * (vector.y >= 0.f ? 1.f : -1.f)
+    };
+  }
+
+  return glm::packSnorm2x8(square);
+}
+
+inline glm::vec3 decodeOctahedral(uint16_t encoded) {
+  auto square = glm::unpackSnorm2x8(encoded);
+  glm::vec3 vector{ square.x, square.y, 1.f - std::abs(square.x) - std::abs(square.y) };
+
+  auto fold = std::max(-vector.z, 0.f);
+  vector.x += vector.x >= 0.f ? -fold : fold;
+  vector.y += vector.y >= 0.f ? -fold : fold;
+
+  return glm::normalize(vector);
+}
+
+inline CompactPhoton compactPhoton(const PhotonHit& photon) {
+  return CompactPhoton{
+    encodeRGBE(photon.power),
+    encodeOctahedral(photon.incidentDirection),
+    encodeOctahedral(photon.normal),
+    (uint16_t)std::min(photon.depth, 0xffffu)
+  };
+}
+
+inline PhotonHit expandPhoton(const CompactPhoton& photon, glm::vec3 position) {
+  return PhotonHit{
+    position,
+    decodeOctahedral(photon.normal),
+    decodeOctahedral(photon.incidentDirection),
+    decodeRGBE(photon.power),
+    photon.depth
+  };
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <limits>
 #include <optional>
 
 #include <embree3/rtcore.h>
@@ -9,21 +11,19 @@
 #include "Utils.hpp"
 #include "Intersection.hpp"
 
-inline std::optional<Intersection> intersectRay(glm::vec3 origin, glm::vec3 direction, std::shared_ptr<Scene> scene) {
-  struct RTCIntersectContext context;
-  rtcInitIntersectContext(&context);
-
-  auto rayHit = rtcRayFrom(origin, direction);
+/// Geometry of the scene whose material and normal transform apply to a hit. Hits inside an instance report the
+/// geometry of the instanced model, so the instance itself is used instead
+inline unsigned int hitGeometryId(unsigned int geometryId, unsigned int instanceId) {
+  return instanceId != RTC_INVALID_GEOMETRY_ID ? instanceId : geometryId;
+}
 
-  rtcIntersect1(scene->scene, &context, &rayHit);
+/// Intersection found by a ray traced by Embree, the ray must have hit something
+inline Intersection intersectionFromRayHit(const RTCRayHit& rayHit, const std::shared_ptr<Scene>& scene) {
+  auto geometryId = hitGeometryId(rayHit.hit.geomID, rayHit.hit.instID[0]);
 
-  if (rayHit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
-    return std::nullopt;
-  }
-
-  auto intersection = Intersection{
-    scene->getMaterial(rayHit.hit.geomID),
-    { rayHit.hit.Ng_x, rayHit.hit.Ng_y, rayHit.hit.Ng_z },
+  return Intersection{
+    &scene->getMaterial(geometryId),
+    scene->getNormalTransform(geometryId) * glm::vec3{ rayHit.hit.Ng_x, rayHit.hit.Ng_y, rayHit.hit.Ng_z },
     {
       rayHit.ray.org_x + rayHit.ray.dir_x * rayHit.ray.tfar,
       rayHit.ray.org_y + rayHit.ray.dir_y * rayHit.ray.tfar,
@@ -40,6 +40,108 @@ inline std::optional<Intersection> intersectRay(glm::vec3 origin, glm::vec3 dire
       rayHit.hit.v,
     }
   };
+}
 
-  return std::make_optional(intersection);
+inline std::optional<Intersection> intersectRay(glm::vec3 origin, glm::vec3 direction, const std::shared_ptr<Scene>& scene) {
+  struct RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+
+  auto rayHit = rtcRayFrom(origin, direction, scene->getSettings().epsilon);
+
+  rtcIntersect1(scene->scene, &context, &rayHit);
+
+  if (rayHit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+    return std::nullopt;
+  }
+
+  return std::make_optional(intersectionFromRayHit(rayHit, scene));
+}
+
+/// Intersects a stream of unrelated rays with the scene in a single call, letting Embree reorder and group them
+/// internally. Suited to rays scattered in every direction, like the bounces of photons
+/// - Parameters:
+///   - rayHits: rays to trace, built with rtcRayFrom. Receive the closest hit of each ray
+///   - count: number of rays
+///   - scene: scene to intersect
+inline void intersectRayStream(RTCRayHit* rayHits, size_t count, const std::shared_ptr<Scene>& scene) {
+  struct RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+  context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+  rtcIntersect1M(scene->scene, &context, rayHits, (unsigned int)count, sizeof(RTCRayHit));
+}
+
+/// Number of rays traced together by intersectRays
+constexpr size_t rayPacketSize = 8;
+
+/// Intersects several rays with the scene, tracing them in packets of rayPacketSize so Embree traverses the scene
+/// once for all of them with SIMD instructions. Works best when the rays are coherent, like camera rays of a tile
+/// - Parameters:
+///   - origins: origin of each ray
+///   - directions: direction of each ray
+///   - count: number of rays
+///   - intersections: receives the closest hit of each ray, or nullopt if the ray hits nothing
+///   - scene: scene to intersect
+///   - coherent: whether rays of a packet travel in similar directions, false for rays scattered over a hemisphere
+inline void intersectRays(
+  const glm::vec3* origins, const glm::vec3* directions, size_t count, std::optional<Intersection>* intersections,
+  const std::shared_ptr<Scene>& scene, bool coherent = true
+) {
+  struct RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+  context.flags = coherent ? RTC_INTERSECT_CONTEXT_FLAG_COHERENT : RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+  auto epsilon = scene->getSettings().epsilon;
+
+  for (size_t first = 0; first < count; first += rayPacketSize) {
+    auto packetSize = std::min(rayPacketSize, count - first);
+
+    RTCRayHit8 rayHit;
+    alignas(32) int valid[rayPacketSize];
+
+    for (size_t lane = 0; lane < rayPacketSize; ++lane) {
+      // Missing rays of the last packet repeat the first one and are masked out
+      auto ray = first + (lane < packetSize ? lane : 0);
+      valid[lane] = lane < packetSize ? -1 : 0;
+
+      rayHit.ray.org_x[lane] = origins[ray].x;
+      rayHit.ray.org_y[lane] = origins[ray].y;
+      rayHit.ray.org_z[lane] = origins[ray].z;
+      rayHit.ray.dir_x[lane] = directions[ray].x;
+      rayHit.ray.dir_y[lane] = directions[ray].y;
+      rayHit.ray.dir_z[lane] = directions[ray].z;
+      rayHit.ray.tnear[lane] = epsilon;
+      rayHit.ray.tfar[lane] = std::numeric_limits<float>::infinity();
+      rayHit.ray.time[lane] = 0.f;
+      rayHit.ray.mask[lane] = -1;
+      rayHit.ray.id[lane] = (unsigned int)lane;
+      rayHit.ray.flags[lane] = 0;
+      rayHit.hit.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+      rayHit.hit.instID[0][lane] = RTC_INVALID_GEOMETRY_ID;
+    }
+
+    rtcIntersect8(valid, scene->scene, &context, &rayHit);
+
+    for (size_t lane = 0; lane < packetSize; ++lane) {
+      if (rayHit.hit.geomID[lane] == RTC_INVALID_GEOMETRY_ID) {
+        intersections[first + lane] = std::nullopt;
+        continue;
+      }
+
+      auto distance = rayHit.ray.tfar[lane];
+      auto geometryId = hitGeometryId(rayHit.hit.geomID[lane], rayHit.hit.instID[0][lane]);
+      intersections[first + lane] = Intersection{
+        &scene->getMaterial(geometryId),
+        scene->getNormalTransform(geometryId) * glm::vec3{ rayHit.hit.Ng_x[lane], rayHit.hit.Ng_y[lane], rayHit.hit.Ng_z[lane] },
+        {
+          rayHit.ray.org_x[lane] + rayHit.ray.dir_x[lane] * distance,
+          rayHit.ray.org_y[lane] + rayHit.ray.dir_y[lane] * distance,
+          rayHit.ray.org_z[lane] + rayHit.ray.dir_z[lane] * distance
+        },
+        { rayHit.ray.dir_x[lane], rayHit.ray.dir_y[lane], rayHit.ray.dir_z[lane] },
+        distance,
+        { rayHit.hit.u[lane], rayHit.hit.v[lane] }
+      };
+    }
+  }
 }
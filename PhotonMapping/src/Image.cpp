@@ -6,9 +6,10 @@
 
 constexpr unsigned int PIXEL_SIZE = 24;
 
-Image::Image(unsigned int width, unsigned int height):
+Image::Image(unsigned int width, unsigned int height, float gammaCorrection):
 width(width),
 height(height),
+_gammaCorrection(gammaCorrection),
 _colorBuffer(std::make_unique<glm::vec3[]>((size_t) height * width)),
 _pixelBuffer(std::make_unique<Color[]>((size_t) height * width))
 {
@@ -24,10 +25,6 @@ void Image::writePixel(unsigned int x, unsigned int y, glm::vec3 color) {
     throw "Error, trying to write pixel in wrong location";
   }
 
-  if (glm::l2Norm(color) > glm::l2Norm(_maxColor)) {
-    _maxColor = color;
-  }
-
   _colorBuffer[y * width + x] = color;
 }
 
@@ -53,14 +50,22 @@ Image::~Image() {
 }
 
 void Image::_performGammaCorrection() {
-  auto gamma = FLOAT_CONSTANTS[GAMMA_CORRECTION];
-  auto maxNorm = glm::l2Norm(_maxColor);
+  auto gamma = _gammaCorrection;
+
+  // The brightest color is searched here instead of in writePixel so pixels can be written concurrently
+  glm::vec3 maxColor{ 0.f };
+  for (unsigned int colorIndex = 0; colorIndex < width * height; colorIndex++) {
+    if (glm::l2Norm(_colorBuffer[colorIndex]) > glm::l2Norm(maxColor)) {
+      maxColor = _colorBuffer[colorIndex];
+    }
+  }
+  auto maxNorm = glm::l2Norm(maxColor);
 
   for (unsigned int colorIndex = 0; colorIndex < width * height; colorIndex++) {
     glm::vec3 currentColor = _colorBuffer[colorIndex];
 
     if (currentColor == glm::vec3{1.f}) {
-      auto maxComp = maxComponent(_maxColor);
+      auto maxComp = maxComponent(maxColor);
       currentColor = glm::vec3{maxComp};
     }
     
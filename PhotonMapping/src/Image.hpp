@@ -10,9 +10,14 @@
 
 class Image {
 public:
-  Image(unsigned int width, unsigned int height);
+    /// Creates a black image
+    /// - Parameters:
+    ///   - width: horizontal size for the image
+    ///   - height: vertical size for the image
+    ///   - gammaCorrection: gamma applied to the colors when the image is saved
+  Image(unsigned int width, unsigned int height, float gammaCorrection);
 
-    /// Writes in the desired pixel the color requested
+    /// Writes in the desired pixel the color requested. Different pixels can be written from different threads
     /// - Parameters:
     ///   - x: horizontal coordinate for the pixel
     ///   - y: vertical coordinate for the pixel
@@ -28,10 +33,10 @@ public:
   const unsigned int width;
   const unsigned int height;
 private:
+  float _gammaCorrection;
   FIBITMAP* _bitmap;
   std::unique_ptr<glm::vec3[]> _colorBuffer;
   std::unique_ptr<Color[]> _pixelBuffer;
-  glm::vec3 _maxColor{ 0.f };
 
   void _performGammaCorrection();
 };
@@ -6,7 +6,8 @@
 #include "Material.hpp"
 
 struct Intersection {
-  Material material;
+  /// Material of the geometry hit, owned by the scene
+  const Material* material;
   glm::vec3 normal;
   glm::vec3 position;
   glm::vec3 direction;
@@ -14,7 +15,7 @@ struct Intersection {
   glm::vec2 uv;
 
   Intersection(
-    Material material,
+    const Material* material,
     glm::vec3 normal,
     glm::vec3 position,
     glm::vec3 direction,
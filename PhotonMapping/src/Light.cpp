@@ -7,35 +7,85 @@
 
 #include "Intersection.hpp"
 #include "Model.hpp"
+#include "Sampler.hpp"
 
-glm::vec3 Light::_intensityFromPoint(glm::vec3 position, Intersection& intersection, RTCScene scene) const {
-  glm::vec3 result{ 0.f };
-  auto directionToLight = glm::normalize(position - intersection.position);
-
-  auto shadowRayHit = rtcRayFrom(intersection.position, directionToLight, glm::distance(position, intersection.position));
+glm::vec3 Light::_intensityFromPoint(
+  glm::vec3 position, Intersection& intersection, RTCScene scene, const RenderSettings& settings
+) const {
+  auto shadowRay = _shadowRay(position, intersection, settings);
 
   struct RTCIntersectContext context;
   rtcInitIntersectContext(&context);
 
   // TODO: Change to intersects with all solids until light and check transparency between them
-  rtcOccluded1(scene, &context, &shadowRayHit.ray);
+  rtcOccluded1(scene, &context, &shadowRay);
 
   // For some reason, >= 0 means we reached light. tfar = -inf if object is occluded
-  if (shadowRayHit.ray.tfar != -std::numeric_limits<float>::infinity()) {
-    auto directionModifier = glm::dot(intersection.normal, directionToLight);
-    auto diffuse = intersection.material.color * color * std::max(directionModifier, 0.f);
+  if (shadowRay.tfar == -std::numeric_limits<float>::infinity()) {
+    return glm::vec3{ 0.f };
+  }
+
+  return _unoccludedIntensityFromPoint(position, intersection);
+}
+
+void Light::intensitiesFrom(
+  const Intersection* const* intersections, size_t count, RTCScene scene, const RenderSettings& settings,
+  ShadowRayBatch& batch, glm::vec3* intensities
+) const {
+  batch.clear();
+  appendShadowRays(intersections, count, settings, batch);
+  if (batch.rays.empty()) {
+    return;
+  }
+
+  // Rays of different points go in every direction, so Embree is told to reorder them
+  struct RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+  context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
 
-    auto distanceToLight = glm::l2Norm(position, intersection.position);
-    auto lightAttenuation = _attenuation(distanceToLight);
+  rtcOccluded1M(scene, &context, batch.rays.data(), (unsigned int)batch.rays.size(), sizeof(RTCRay));
 
-    result += lightAttenuation * _intensity * diffuse;
+  auto sampleWeight = 1.f / (float)shadowRaysPerPoint();
+  for (size_t ray = 0; ray < batch.rays.size(); ++ray) {
+    if (batch.rays[ray].tfar != -std::numeric_limits<float>::infinity()) {
+      auto point = batch.points[ray];
+      intensities[point] += sampleWeight * _unoccludedIntensityFromPoint(batch.lightPoints[ray], *intersections[point]);
+    }
   }
+}
+
+RTCRay Light::_shadowRay(glm::vec3 position, const Intersection& intersection, const RenderSettings& settings) const {
+  auto directionToLight = glm::normalize(position - intersection.position);
+  auto distance = glm::distance(position, intersection.position);
+
+  return rtcRayFrom(intersection.position, directionToLight, settings.epsilon, distance).ray;
+}
+
+glm::vec3 Light::_unoccludedIntensityFromPoint(glm::vec3 position, const Intersection& intersection) const {
+  auto directionToLight = glm::normalize(position - intersection.position);
+  auto directionModifier = glm::dot(intersection.normal, directionToLight);
+  auto diffuse = intersection.material->color * color * std::max(directionModifier, 0.f);
 
-  return result;
+  auto distanceToLight = glm::l2Norm(position, intersection.position);
+  auto lightAttenuation = _attenuation(distanceToLight);
+
+  return lightAttenuation * _intensity * diffuse;
 }
 
-glm::vec3 PointLight::intensityFrom(Intersection& intersection, RTCScene scene) const {
-  return _intensityFromPoint(position, intersection, scene);
+glm::vec3 PointLight::intensityFrom(
+  Intersection& intersection, RTCScene scene, const RenderSettings& settings
+) const {
+  return _intensityFromPoint(position, intersection, scene, settings);
+}
+
+void PointLight::appendShadowRays(
+  const Intersection* const* intersections, size_t count, const RenderSettings& settings, ShadowRayBatch& batch
+) const {
+  for (size_t point = 0; point < count; ++point) {
+    batch.rays.push_back(_shadowRay(position, *intersections[point], settings));
+    batch.lightPoints.push_back(position);
+    batch.points.push_back((uint32_t)point);
+  }
 }
 
 std::shared_ptr<Model> PointLight::getModel() const {
@@ -48,7 +98,8 @@ std::shared_ptr<Model> AreaLight::getModel() const {
 
 AreaLight::AreaLight(
   glm::vec3 position, glm::vec3 color, float intensity, float constantDecay, float linearDecay,
-  float quadraticDecay, glm::vec3 uvec, glm::vec3 vvec, size_t usteps, size_t vsteps, RTCDevice device
+  float quadraticDecay, glm::vec3 uvec, glm::vec3 vvec, size_t usteps, size_t vsteps, float surfaceOffset,
+  RTCDevice device
 ) :
   Light(position, color, intensity, constantDecay, linearDecay, quadraticDecay),
   _uvec(uvec), _vvec(vvec), _usteps(usteps), _vsteps(vsteps) {
@@ -57,38 +108,80 @@ AreaLight::AreaLight(
   _udirection = uvec / (float)usteps;
   _vdirection = vvec / (float)vsteps;
 
+  // Move corner on normal direction to let light shine
+  auto normal = glm::normalize(glm::cross(uvec, vvec));
+
   _model = std::make_shared<Model>(Material {
       glm::vec3 { 1.f, 1.f, 1.f }, 1.f, 0.f, 0.f, 0.f, true
-    }, device, _corner, uvec, vvec);
+    }, device, _corner - normal * surfaceOffset, uvec, vvec);
 }
 
-glm::vec3 AreaLight::intensityFrom(Intersection& intersection, RTCScene scene) const {
+glm::vec3 AreaLight::intensityFrom(
+  Intersection& intersection, RTCScene scene, const RenderSettings& settings
+) const {
   glm::vec3 color{ 0.f };
 
-  auto lightPoints = _lightSourcePoints();
+  // Both buffers are reused by every shading point of the thread, so shading does not allocate
+  thread_local std::vector<glm::vec3> lightPoints;
+  lightPoints.clear();
+  _lightSourcePoints(lightPoints);
 
+  // All shadow rays of the light start at the same point, so they are traced together as a coherent stream instead
+  // of one rtcOccluded1 call per point
+  thread_local std::vector<RTCRay> shadowRays;
+  shadowRays.clear();
   for (auto lightPoint : lightPoints) {
-    color += _intensityFromPoint(lightPoint, intersection, scene);
+    shadowRays.push_back(_shadowRay(lightPoint, intersection, settings));
+  }
+
+  struct RTCIntersectContext context;
+  rtcInitIntersectContext(&context);
+  context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+  rtcOccluded1M(scene, &context, shadowRays.data(), (unsigned int)shadowRays.size(), sizeof(RTCRay));
+
+  for (size_t i = 0; i < lightPoints.size(); ++i) {
+    if (shadowRays[i].tfar != -std::numeric_limits<float>::infinity()) {
+      color += _unoccludedIntensityFromPoint(lightPoints[i], intersection);
+    }
   }
 
   return color / (float)lightPoints.size();
 }
 
-std::vector<glm::vec3> AreaLight::_lightSourcePoints() const {
-  std::vector<glm::vec3> points;
+void AreaLight::appendShadowRays(
+  const Intersection* const* intersections, size_t count, const RenderSettings& settings, ShadowRayBatch& batch
+) const {
+  // Every point draws its own jittered points on the light, like intensityFrom does
+  for (size_t point = 0; point < count; ++point) {
+    auto firstRay = batch.lightPoints.size();
+    _lightSourcePoints(batch.lightPoints);
+
+    for (auto ray = firstRay; ray < batch.lightPoints.size(); ++ray) {
+      batch.rays.push_back(_shadowRay(batch.lightPoints[ray], *intersections[point], settings));
+      batch.points.push_back((uint32_t)point);
+    }
+  }
+}
+
+void AreaLight::_lightSourcePoints(std::vector<glm::vec3>& points) const {
+  // The jitter of every cell is drawn in one batch instead of two calls per point
+  thread_local std::vector<float> jitter;
+  jitter.resize(2 * _usteps * _vsteps);
+  threadSampler().fill01(jitter.data(), jitter.size());
+
   for (size_t u = 0; u < _usteps; ++u) {
     for (size_t v = 0; v < _vsteps; ++v) {
-      points.push_back(_pointOnLight(u, v));
+      auto cell = 2 * (u * _vsteps + v);
+      points.push_back(_pointOnLight(u, v, jitter[cell], jitter[cell + 1]));
     }
   }
-
-  return points;
 }
 
-inline glm::vec3 AreaLight::_pointOnLight(size_t u, size_t v) const {
+inline glm::vec3 AreaLight::_pointOnLight(size_t u, size_t v, float uJitter, float vJitter) const {
   // We sample points in random locations allowing softer shadows
-  auto uMiddle = (float)u + rand01();
-  auto vMiddle = (float)v + rand01();
+  auto uMiddle = (float)u + uJitter;
+  auto vMiddle = (float)v + vJitter;
   return _corner + _udirection * uMiddle + _vdirection * vMiddle;
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Constants.hpp"
+#include "RenderSettings.hpp"
 #include "Utils.hpp"
 #include <vector>
 #include <memory>
@@ -13,9 +14,52 @@ class Model;
 
 struct Intersection;
 
+/// Shadow rays of many shading points collected to be traced together. Buffers are kept between batches so they only
+/// allocate while growing
+struct ShadowRayBatch {
+  std::vector<RTCRay> rays;
+  /// Point of the light each ray ends at
+  std::vector<glm::vec3> lightPoints;
+  /// Index of the shading point each ray starts from
+  std::vector<uint32_t> points;
+
+  void clear() {
+    rays.clear();
+    lightPoints.clear();
+    points.clear();
+  }
+};
+
 class Light {
 public:
-  virtual glm::vec3 intensityFrom(Intersection& intersection, RTCScene scene) const = 0;
+  virtual glm::vec3 intensityFrom(Intersection& intersection, RTCScene scene, const RenderSettings& settings) const = 0;
+
+  /// Appends the shadow rays of every intersection to the batch, shadowRaysPerPoint rays each
+  /// - Parameters:
+  ///   - intersections: shading points
+  ///   - count: number of shading points
+  ///   - settings: render parameters
+  ///   - batch: receives the rays, tagged with the index of their shading point
+  virtual void appendShadowRays(
+    const Intersection* const* intersections, size_t count, const RenderSettings& settings, ShadowRayBatch& batch
+  ) const = 0;
+
+  /// Number of shadow rays appended per shading point, the light received is their average
+  virtual size_t shadowRaysPerPoint() const = 0;
+
+  /// Adds the light received by every intersection to its intensity, as intensityFrom does, but tracing the shadow
+  /// rays of all of them with a single stream call
+  /// - Parameters:
+  ///   - intersections: shading points
+  ///   - count: number of shading points
+  ///   - scene: scene blocking the light
+  ///   - settings: render parameters
+  ///   - batch: scratch buffers, cleared before use
+  ///   - intensities: light received by each shading point, added to
+  void intensitiesFrom(
+    const Intersection* const* intersections, size_t count, RTCScene scene, const RenderSettings& settings,
+    ShadowRayBatch& batch, glm::vec3* intensities
+  ) const;
   virtual std::shared_ptr<Model> getModel() const = 0;
 
   glm::vec3 position, color;
@@ -33,7 +77,15 @@ protected:
     return 1.f / (_constantDecay + _linearDecay * distance + _quadraticDecay * glm::pow(distance, 2.f));
   }
 
-  glm::vec3 _intensityFromPoint(glm::vec3 position, Intersection& intersection, RTCScene scene) const;
+  glm::vec3 _intensityFromPoint(
+    glm::vec3 position, Intersection& intersection, RTCScene scene, const RenderSettings& settings
+  ) const;
+
+  /// Ray from the intersection to the point of the light, ending at the light
+  RTCRay _shadowRay(glm::vec3 position, const Intersection& intersection, const RenderSettings& settings) const;
+
+  /// Light received by the intersection from the point assuming nothing blocks it
+  glm::vec3 _unoccludedIntensityFromPoint(glm::vec3 position, const Intersection& intersection) const;
 };
 
 class PointLight : public Light {
@@ -41,7 +93,15 @@ public:
   PointLight(glm::vec3 position, glm::vec3 color, float intensity, float constantDecay, float linearDecay, float quadraticDecay) :
     Light(position, color, intensity, constantDecay, linearDecay, quadraticDecay) {}
 
-  glm::vec3 intensityFrom(Intersection& intersection, RTCScene scene) const;
+  glm::vec3 intensityFrom(Intersection& intersection, RTCScene scene, const RenderSettings& settings) const;
+
+  void appendShadowRays(
+    const Intersection* const* intersections, size_t count, const RenderSettings& settings, ShadowRayBatch& batch
+  ) const;
+
+  size_t shadowRaysPerPoint() const {
+    return 1;
+  }
 
   std::shared_ptr<Model> getModel() const;
 
@@ -54,10 +114,19 @@ class AreaLight : public Light {
 public:
   AreaLight(
     glm::vec3 position, glm::vec3 color, float intensity, float constantDecay, float linearDecay,
-    float quadraticDecay, glm::vec3 uvec, glm::vec3 vvec, size_t usteps, size_t vsteps, RTCDevice device
+    float quadraticDecay, glm::vec3 uvec, glm::vec3 vvec, size_t usteps, size_t vsteps, float surfaceOffset,
+    RTCDevice device
   );
 
-  glm::vec3 intensityFrom(Intersection& intersection, RTCScene scene) const;
+  glm::vec3 intensityFrom(Intersection& intersection, RTCScene scene, const RenderSettings& settings) const;
+
+  void appendShadowRays(
+    const Intersection* const* intersections, size_t count, const RenderSettings& settings, ShadowRayBatch& batch
+  ) const;
+
+  size_t shadowRaysPerPoint() const {
+    return _usteps * _vsteps;
+  }
 
   std::shared_ptr<Model> getModel() const;
 
@@ -77,6 +146,9 @@ private:
   size_t _usteps;
   size_t _vsteps;
 
-  inline glm::vec3 _pointOnLight(size_t u, size_t v) const;
-  std::vector<glm::vec3> _lightSourcePoints() const;
+  inline glm::vec3 _pointOnLight(size_t u, size_t v, float uJitter, float vJitter) const;
+
+  /// Appends one jittered point per cell of the light, usteps * vsteps points
+  /// - Parameter points: buffer receiving the points, reused by the caller so no allocation happens once it is warm
+  void _lightSourcePoints(std::vector<glm::vec3>& points) const;
 };
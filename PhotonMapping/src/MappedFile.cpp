@@ -0,0 +1,108 @@
+#include "MappedFile.hpp"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename) {
+  _file = CreateFileA(
+    filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr
+  );
+  if (_file == INVALID_HANDLE_VALUE) {
+    _file = nullptr;
+    throw std::invalid_argument("MappedFile(): could not open file " + filename);
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(_file, &size)) {
+    CloseHandle(_file);
+    throw std::invalid_argument("MappedFile(): could not read size of file " + filename);
+  }
+  _size = (size_t)size.QuadPart;
+
+  // Empty files can not be mapped, they are exposed as an empty range instead
+  if (_size == 0) {
+    return;
+  }
+
+  _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (_mapping == nullptr) {
+    CloseHandle(_file);
+    throw std::invalid_argument("MappedFile(): could not map file " + filename);
+  }
+
+  _data = (const unsigned char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+  if (_data == nullptr) {
+    CloseHandle(_mapping);
+    CloseHandle(_file);
+    throw std::invalid_argument("MappedFile(): could not map file " + filename);
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (_data != nullptr) {
+    UnmapViewOfFile(_data);
+  }
+  if (_mapping != nullptr) {
+    CloseHandle(_mapping);
+  }
+  if (_file != nullptr) {
+    CloseHandle(_file);
+  }
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename) {
+  auto descriptor = open(filename.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    throw std::invalid_argument("MappedFile(): could not open file " + filename);
+  }
+
+  struct stat status;
+  if (fstat(descriptor, &status) != 0) {
+    close(descriptor);
+    throw std::invalid_argument("MappedFile(): could not read size of file " + filename);
+  }
+  _size = (size_t)status.st_size;
+
+  // Empty files can not be mapped, they are exposed as an empty range instead
+  if (_size > 0) {
+    auto data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, descriptor, 0);
+    if (data == MAP_FAILED) {
+      close(descriptor);
+      throw std::invalid_argument("MappedFile(): could not map file " + filename);
+    }
+    _data = (const unsigned char*)data;
+  }
+
+  // The mapping keeps its own reference to the file
+  close(descriptor);
+}
+
+MappedFile::~MappedFile() {
+  if (_data != nullptr) {
+    munmap((void*)_data, _size);
+  }
+}
+
+#endif
+
+const unsigned char* MappedFile::data() const {
+  return _data;
+}
+
+size_t MappedFile::size() const {
+  return _size;
+}
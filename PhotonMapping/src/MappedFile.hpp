@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/// Read-only memory mapping of a whole file. Pages are loaded by the OS on first access and shared between every
+/// process mapping the same file, so opening a large file is immediate and costs no private memory
+class MappedFile {
+public:
+  /// Maps the file, throws std::invalid_argument if it can not be opened or mapped
+  /// - Parameter filename: path of the file
+  explicit MappedFile(const std::string& filename);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const unsigned char* data() const;
+
+  size_t size() const;
+
+private:
+  const unsigned char* _data = nullptr;
+  size_t _size = 0;
+
+#ifdef _WIN32
+  void* _file = nullptr;
+  void* _mapping = nullptr;
+#endif
+};
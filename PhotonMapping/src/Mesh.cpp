@@ -2,13 +2,42 @@
 
 #include <iostream>
 
-unsigned int lastGeometryID = 0;
+Mesh::Mesh(size_t vertexCount, size_t triangleCount, Material material, RTCDevice device) {
+  _setupMesh(vertexCount, triangleCount, device, material);
+}
+
+Mesh::Mesh(
+  const float* vertices, size_t vertexCount, const unsigned int* indices, size_t triangleCount, Material material,
+  RTCDevice device
+) : _vertexCount(vertexCount), _triangleCount(triangleCount), _material(material) {
+  _geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+
+  // Embree only reads shared buffers, the casts are required by its signature
+  rtcSetSharedGeometryBuffer(_geometry,
+                             RTC_BUFFER_TYPE_VERTEX,
+                             0,
+                             RTC_FORMAT_FLOAT3,
+                             (void*)vertices,
+                             0,
+                             3 * sizeof(float),
+                             vertexCount);
+
+  rtcSetSharedGeometryBuffer(_geometry,
+                             RTC_BUFFER_TYPE_INDEX,
+                             0,
+                             RTC_FORMAT_UINT3,
+                             (void*)indices,
+                             0,
+                             3 * sizeof(unsigned),
+                             triangleCount);
+}
 
-Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, Material material, RTCDevice device) {
-  this->vertices = vertices;
-  this->indices = indices;
+Mesh::Mesh(RTCScene prototype, const glm::mat4& transform, Material material, RTCDevice device) :
+  _material(material), _normalTransform(glm::transpose(glm::inverse(glm::mat3(transform)))) {
+  _geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
 
-  _setupMesh(device, material);
+  rtcSetGeometryInstancedScene(_geometry, prototype);
+  rtcSetGeometryTransform(_geometry, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &transform[0][0]);
 }
 
 Mesh::Mesh(const RTCGeometryType type, RTCDevice device, glm::vec4 transform, Material material) {
@@ -19,38 +48,23 @@ Mesh::Mesh(Material material, glm::vec3 corner, glm::vec3 uvec, glm::vec3 vvec,
   _setupQuad(material, corner, uvec, vvec, device);
 }
 
-std::pair<unsigned int, Material> Mesh::getMaterialPair() const {
-  // NOTE: THIS IS NOT MULTI THREAD SAFE
-  // THERE IS NO DOC ON HOW GEOMETRY ID IS ASSIGNED. BUT THERE IS SOME EXAMPLE WHERE THEY JUST USE CONSECUTIVE NUMBERS
-  // https://github.com/embree/embree/blob/master/tutorials/user_geometry/user_geometry_device.cpp
-  return { lastGeometryID++, _material };
-}
-
-void Mesh::_setupMesh(RTCDevice device, Material material) {
+void Mesh::_setupMesh(size_t vertexCount, size_t triangleCount, RTCDevice device, Material material) {
+  _vertexCount = vertexCount;
+  _triangleCount = triangleCount;
   _geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
   vertexBuffer = (float*)rtcSetNewGeometryBuffer(_geometry,
                                                  RTC_BUFFER_TYPE_VERTEX,
                                                  0,
                                                  RTC_FORMAT_FLOAT3,
                                                  3 * sizeof(float),
-                                                 vertices.size());
+                                                 vertexCount);
 
   indexBuffer = (unsigned*)rtcSetNewGeometryBuffer(_geometry,
                                                    RTC_BUFFER_TYPE_INDEX,
                                                    0,
                                                    RTC_FORMAT_UINT3,
-                                                   1 * sizeof(unsigned),
-                                                   indices.size());
-
-  for (unsigned int i = 0; i < vertices.size(); ++i) {
-    vertexBuffer[i * 3] = vertices[i].Position.x;
-    vertexBuffer[i * 3 + 1] = vertices[i].Position.y;
-    vertexBuffer[i * 3 + 2] = vertices[i].Position.z;
-  }
-
-  for (unsigned int i = 0; i < indices.size(); ++i) {
-    indexBuffer[i] = indices[i];
-  }
+                                                   3 * sizeof(unsigned),
+                                                   triangleCount);
 
   // TODO: Change this to the actual texture
   _material = material;
@@ -75,9 +89,8 @@ void Mesh::_setupQuad(Material material, glm::vec3 corner, glm::vec3 uvec, glm::
   auto normal = glm::normalize(glm::cross(uvec, vvec));
 
   std::cout << "corner is " << corner.x << "," << corner.y << "," << corner.z << std::endl;
-  // Move corner on normal direction to let light shine
-  auto origin = corner - normal * FLOAT_CONSTANTS[EPSILON];
-  std::cout << "normal is " << normal.x << "," << normal.y << "," << normal.z << ". Float is: " << FLOAT_CONSTANTS[EPSILON] << std::endl;
+  auto origin = corner;
+  std::cout << "normal is " << normal.x << "," << normal.y << "," << normal.z << std::endl;
 
   std::cout << "origin is " << origin.x << "," << origin.y << "," << origin.z << std::endl;
   float* vb = (float*) rtcSetNewGeometryBuffer(_geometry,
@@ -94,10 +107,12 @@ void Mesh::_setupQuad(Material material, glm::vec3 corner, glm::vec3 uvec, glm::
   _material = material;
 }
 
-void Mesh::commit(RTCScene scene) {
+unsigned int Mesh::commit(RTCScene scene) const {
   rtcCommitGeometry(_geometry);
 
-  rtcAttachGeometry(scene, _geometry);
+  auto geometryId = rtcAttachGeometry(scene, _geometry);
 
   rtcReleaseGeometry(_geometry);
+
+  return geometryId;
 }
@@ -4,50 +4,95 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <embree3/rtcore.h>
 
-#include <string>
-#include <vector>
-
 #include "Material.hpp"
 
-struct Vertex {
-    // position
-  glm::vec3 Position;
-};
-
 /// Mesh representing list of vertices and indices used to then generate geometries in the embree scene
 class Mesh {
 public:
-  std::vector<Vertex> vertices;
-  std::vector<unsigned int> indices;
-
-  /// Constructs a mesh from verticies and indices. Also needs a device to create the geometries for embree.
+  /// Constructs a triangle mesh whose vertex and index buffers are allocated by embree but left unfilled. The loader
+  /// writes the data straight into getVertexBuffer and getIndexBuffer, so the mesh is never held in a second copy.
   /// - Parameters:
-  ///   - vertices: Vector of vertices for the mesh
-  ///   - indices: Vector of indices for the mesh
+  ///   - vertexCount: number of vertices of the mesh
+  ///   - triangleCount: number of triangles of the mesh
+  ///   - material: material for mesh
   ///   - device: device to generate geometries
+  Mesh(size_t vertexCount, size_t triangleCount, Material material, RTCDevice device);
+
+  /// Constructs a triangle mesh tracing vertices and indices in place from memory owned by the caller, which must
+  /// outlive the scene. The vertex array must be readable 4 bytes past the last vertex
+  /// - Parameters:
+  ///   - vertices: three floats per vertex
+  ///   - vertexCount: number of vertices of the mesh
+  ///   - indices: three indices per triangle
+  ///   - triangleCount: number of triangles of the mesh
   ///   - material: material for mesh
-  Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, Material material, RTCDevice device);
+  ///   - device: device to generate geometries
+  Mesh(
+    const float* vertices, size_t vertexCount, const unsigned int* indices, size_t triangleCount, Material material,
+    RTCDevice device
+  );
+
+  /// Constructs an instance placing a scene of meshes committed once, so its triangles are stored a single time no
+  /// matter how many instances use it
+  /// - Parameters:
+  ///   - prototype: committed scene placed by the instance, must outlive the instance
+  ///   - transform: object to world transform of the instance
+  ///   - material: material for every mesh of the instance
+  ///   - device: device to generate geometries
+  Mesh(RTCScene prototype, const glm::mat4& transform, Material material, RTCDevice device);
 
   Mesh(const RTCGeometryType type, RTCDevice device, glm::vec4 transform, Material material);
 
   Mesh(Material material, glm::vec3 corner, glm::vec3 uvec, glm::vec3 vvec, RTCDevice);
 
-  /// Commits geometries to the ray tracing scene
+  /// Commits geometries to the ray tracing scene and returns the geometry id Embree assigned to it
   /// - Parameter scene: ray tracing scene that will contain the geometries
-  void commit(RTCScene scene);
+  unsigned int commit(RTCScene scene) const;
+
+  /// Returns the vertex buffer of a triangle mesh, three floats per vertex. Null if the mesh traces memory of the caller
+  float* getVertexBuffer() const {
+    return vertexBuffer;
+  }
+
+  /// Returns the index buffer of a triangle mesh, three indices per triangle. Null if the mesh traces memory of the
+  /// caller
+  unsigned int* getIndexBuffer() const {
+    return indexBuffer;
+  }
+
+  /// Returns the number of vertices of a triangle mesh
+  size_t getVertexCount() const {
+    return _vertexCount;
+  }
+
+  /// Returns the number of triangles of a triangle mesh
+  size_t getTriangleCount() const {
+    return _triangleCount;
+  }
+
+  /// Returns the matrix taking normals reported by embree to world space. Identity unless the mesh is an instance,
+  /// whose hits report normals in the space of the prototype
+  const glm::mat3& getNormalTransform() const {
+    return _normalTransform;
+  }
 
-  /// Returns pair of material and geometry id allowing to add it to maps
-  std::pair<unsigned int, Material> getMaterialPair() const;
+  /// Returns the material of the mesh
+  const Material& getMaterial() const {
+    return _material;
+  }
 
 private:
   /// render data
-  float *vertexBuffer;
-  unsigned int *indexBuffer;
+  float *vertexBuffer = nullptr;
+  unsigned int *indexBuffer = nullptr;
+  size_t _vertexCount = 0;
+  size_t _triangleCount = 0;
   RTCGeometry _geometry;
   Material _material;
+  glm::mat3 _normalTransform{ 1.f };
 
   /// initializes all the buffer objects/arrays
-  void _setupMesh(RTCDevice device, Material material);
+  void _setupMesh(size_t vertexCount, size_t triangleCount, RTCDevice device, Material material);
   void _setupPrimitive(const RTCGeometryType type, RTCDevice device, glm::vec4 transform, Material material);
   void _setupQuad(Material material, glm::vec3 corner, glm::vec3 uvec, glm::vec3 vvec, RTCDevice device);
 };
@@ -0,0 +1,196 @@
+#include "MeshCache.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+#include "BinaryFile.hpp"
+
+/// Start of every mesh cache. The version changes with the layout or with the import flags, so caches written by
+/// another build are imported again
+constexpr char meshCacheMagic[8] = { 'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H' };
+constexpr uint32_t meshCacheVersion = 1;
+
+/// Bytes after the last vertex, embree reads vertices of shared buffers with 16 byte loads
+constexpr uint64_t meshCacheVertexPadding = 4;
+
+/// First bytes of a mesh cache file, followed by one entry per mesh. Offsets are from the start of the file
+struct MeshCacheFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t meshCount;
+  uint64_t contentHash;
+  uint64_t entriesOffset;
+};
+
+struct MeshCacheEntry {
+  uint64_t vertexCount;
+  uint64_t triangleCount;
+  uint64_t verticesOffset;
+  uint64_t indicesOffset;
+};
+
+/// FNV-1a over 8 byte words, with the size mixed in so files differing only in trailing zeros get different hashes.
+/// Never returns 0, which marks an asset that could not be hashed
+static uint64_t hashContent(const unsigned char* data, size_t size) {
+  constexpr uint64_t prime = 0x100000001b3ull;
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  size_t offset = 0;
+  for (; offset + sizeof(uint64_t) <= size; offset += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data + offset, sizeof(word));
+    hash = (hash ^ word) * prime;
+  }
+  for (; offset < size; ++offset) {
+    hash = (hash ^ data[offset]) * prime;
+  }
+  hash = (hash ^ (uint64_t)size) * prime;
+
+  return hash == 0 ? 1 : hash;
+}
+
+MeshCache::MeshCache(const std::string& assetPath) : _cachePath(assetPath + ".meshcache") {
+  try {
+    MappedFile asset(assetPath);
+    _contentHash = hashContent(asset.data(), asset.size());
+  } catch (const std::invalid_argument&) {
+    // Left to the importer, which reports the missing asset
+    _contentHash = 0;
+  }
+}
+
+bool MeshCache::load() {
+  if (_contentHash == 0 || !std::filesystem::exists(_cachePath)) {
+    return false;
+  }
+
+  std::shared_ptr<MappedFile> file;
+  try {
+    file = std::make_shared<MappedFile>(_cachePath);
+  } catch (const std::invalid_argument&) {
+    return false;
+  }
+  auto fileSize = (uint64_t)file->size();
+
+  MeshCacheFileHeader header;
+  if (fileSize < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, file->data(), sizeof(header));
+
+  if (
+    std::memcmp(header.magic, meshCacheMagic, sizeof(meshCacheMagic)) != 0 || header.version != meshCacheVersion ||
+    header.contentHash != _contentHash
+  ) {
+    return false;
+  }
+
+  if (
+    header.entriesOffset % alignof(MeshCacheEntry) != 0 || header.entriesOffset > fileSize ||
+    header.meshCount > (fileSize - header.entriesOffset) / sizeof(MeshCacheEntry)
+  ) {
+    std::cout << "Ignoring truncated mesh cache " << _cachePath << std::endl;
+    return false;
+  }
+
+  std::vector<CachedMesh> meshes;
+  meshes.reserve(header.meshCount);
+
+  for (uint32_t i = 0; i < header.meshCount; ++i) {
+    MeshCacheEntry entry;
+    std::memcpy(&entry, file->data() + header.entriesOffset + i * sizeof(MeshCacheEntry), sizeof(entry));
+
+    if (
+      entry.vertexCount > std::numeric_limits<uint32_t>::max() ||
+      entry.triangleCount > std::numeric_limits<uint32_t>::max() ||
+      !isSectionValid(entry.verticesOffset, entry.vertexCount * 3 + 1, sizeof(float), fileSize) ||
+      !isSectionValid(entry.indicesOffset, entry.triangleCount * 3, sizeof(unsigned int), fileSize)
+    ) {
+      std::cout << "Ignoring truncated mesh cache " << _cachePath << std::endl;
+      return false;
+    }
+
+    meshes.push_back(CachedMesh{
+      (const float*)(file->data() + entry.verticesOffset),
+      entry.vertexCount,
+      (const unsigned int*)(file->data() + entry.indicesOffset),
+      entry.triangleCount
+    });
+  }
+
+  _file = file;
+  _meshes = std::move(meshes);
+  return true;
+}
+
+const std::vector<CachedMesh>& MeshCache::getMeshes() const {
+  return _meshes;
+}
+
+void MeshCache::save(const std::vector<CachedMesh>& meshes) const {
+  if (_contentHash == 0) {
+    return;
+  }
+
+  // Written under a name of its own and renamed, so a model loaded twice at the same time never reads a partial file
+  auto threadId = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  auto temporaryPath = _cachePath + ".tmp" + std::to_string(threadId);
+
+  {
+    std::ofstream file(temporaryPath, std::ios::binary);
+
+    if (!file.is_open()) {
+      std::cout << "Could not write mesh cache " << _cachePath << std::endl;
+      return;
+    }
+
+    MeshCacheFileHeader header{};
+    std::memcpy(header.magic, meshCacheMagic, sizeof(meshCacheMagic));
+    header.version = meshCacheVersion;
+    header.meshCount = (uint32_t)meshes.size();
+    header.contentHash = _contentHash;
+    header.entriesOffset = alignOffset(sizeof(MeshCacheFileHeader));
+
+    std::vector<MeshCacheEntry> entries(meshes.size());
+    auto nextOffset = alignOffset(header.entriesOffset + sizeof(MeshCacheEntry) * entries.size());
+    for (size_t i = 0; i < meshes.size(); ++i) {
+      entries[i].vertexCount = meshes[i].vertexCount;
+      entries[i].triangleCount = meshes[i].triangleCount;
+      entries[i].verticesOffset = nextOffset;
+      entries[i].indicesOffset = alignOffset(
+        nextOffset + sizeof(float) * 3 * meshes[i].vertexCount + meshCacheVertexPadding
+      );
+      nextOffset = alignOffset(entries[i].indicesOffset + sizeof(unsigned int) * 3 * meshes[i].triangleCount);
+    }
+
+    // The gap before each index section leaves the zeroed vertex padding
+    BinaryFileWriter writer(file);
+    writer.writeSection(0, &header, sizeof(header));
+    writer.writeSection(header.entriesOffset, entries.data(), sizeof(MeshCacheEntry) * entries.size());
+    for (size_t i = 0; i < meshes.size(); ++i) {
+      writer.writeSection(entries[i].verticesOffset, meshes[i].vertices, sizeof(float) * 3 * meshes[i].vertexCount);
+      writer.writeSection(entries[i].indicesOffset, meshes[i].indices, sizeof(unsigned int) * 3 * meshes[i].triangleCount);
+    }
+
+    if (!file) {
+      std::cout << "Could not write mesh cache " << _cachePath << std::endl;
+      file.close();
+      std::error_code error;
+      std::filesystem::remove(temporaryPath, error);
+      return;
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temporaryPath, _cachePath, error);
+  if (error) {
+    std::cout << "Could not write mesh cache " << _cachePath << ": " << error.message() << std::endl;
+    std::filesystem::remove(temporaryPath, error);
+  }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MappedFile.hpp"
+
+/// Triangle mesh stored in a mesh cache, three floats per vertex and three indices per triangle
+struct CachedMesh {
+  const float* vertices;
+  uint64_t vertexCount;
+  const unsigned int* indices;
+  uint64_t triangleCount;
+};
+
+/// Triangulated meshes of a model file kept next to it as <assetPath>.meshcache, so later runs skip assimp.
+/// The cache is tagged with a hash of the content of the asset and ignored as soon as the asset changes.
+/// Arrays are aligned and padded in the file so embree can trace them in place from the mapping
+class MeshCache {
+public:
+  /// Hashes the content of the asset, which takes a single pass over the file
+  /// - Parameter assetPath: path of the model file
+  explicit MeshCache(const std::string& assetPath);
+
+  /// Maps the cache if it exists and was written from the current content of the asset. Returns false otherwise,
+  /// then the asset must be imported and the cache written with save
+  bool load();
+
+  /// Meshes read by load. They point into the mapped cache, which stays open while this object lives
+  const std::vector<CachedMesh>& getMeshes() const;
+
+  /// Writes the meshes imported from the asset. Failures are only reported, the cache just saves time
+  /// - Parameter meshes: meshes of the asset
+  void save(const std::vector<CachedMesh>& meshes) const;
+
+private:
+  std::string _cachePath;
+  /// Hash of the asset, 0 when the asset could not be read and the cache is not used
+  uint64_t _contentHash = 0;
+  std::shared_ptr<MappedFile> _file;
+  std::vector<CachedMesh> _meshes;
+};
@@ -1,5 +1,6 @@
 #include "./Model.hpp"
 
+#include <cstring>
 #include <iostream>
 
 Model::Model(const std::string& objectPath, Material material, RTCDevice device) : _device(device) {
@@ -14,35 +15,53 @@ Model::Model(Material material, RTCDevice device, glm::vec3 corner, glm::vec3 uv
   _loadQuad(material, corner, uvec, vvec);
 }
 
-void Model::commit(RTCScene scene) const  {
-  for (auto mesh : _meshes) {
-    mesh.commit(scene);
-  }
+Model::Model(std::shared_ptr<ModelPrototype> prototype, Material material, RTCDevice device, glm::mat4 transform) :
+  _device(device), _prototype(prototype) {
+  _meshes.push_back(Mesh(prototype->getScene(), transform, material, _device));
 }
 
-std::unordered_map<unsigned int, Material> Model::getMaterialsMap() const {
-  return _materials;
+void Model::commit(RTCScene scene, std::vector<Material>& materials, std::vector<glm::mat3>& normalTransforms) const  {
+  for (const auto& mesh : _meshes) {
+    auto geometryId = mesh.commit(scene);
+
+    if (geometryId >= materials.size()) {
+      materials.resize(geometryId + 1);
+      normalTransforms.resize(geometryId + 1, glm::mat3{ 1.f });
+    }
+    materials[geometryId] = mesh.getMaterial();
+    normalTransforms[geometryId] = mesh.getNormalTransform();
+  }
 }
 
 void Model::_loadPrimitive(const RTCGeometryType geometryType, glm::vec4 transform, Material material) {
   auto mesh = Mesh(geometryType, _device, transform, material);
 
   _meshes.push_back(mesh);
-  _materials.insert(mesh.getMaterialPair());
 }
 
 void Model::_loadQuad(Material material, glm::vec3 corner, glm::vec3 uvec, glm::vec3 vvec) {
   auto mesh = Mesh(material, corner, uvec, vvec, _device);
 
   _meshes.push_back(mesh);
-  _materials.insert(mesh.getMaterialPair());
 }
 
 void Model::_loadModel(std::string const &path, Material material) {
+  auto cache = std::make_shared<MeshCache>(path);
+
+  if (cache->load()) {
+    for (const auto& mesh : cache->getMeshes()) {
+      _meshes.push_back(Mesh(mesh.vertices, mesh.vertexCount, mesh.indices, mesh.triangleCount, material, _device));
+    }
+
+    // The meshes are traced in place from the mapped cache, which must stay open as long as the model
+    _meshCache = cache;
+    std::cout << "Loaded " << path << " from its mesh cache" << std::endl;
+    return;
+  }
+
   Assimp::Importer importer;
-  const aiScene* scene = importer.ReadFile(path,
-                                           aiProcess_Triangulate | aiProcess_GenSmoothNormals |
-                                           aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+  // Only positions are traced, so normals, tangents and uvs are not generated
+  const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate);
 
   if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
   {
@@ -52,14 +71,20 @@ void Model::_loadModel(std::string const &path, Material material) {
 
     // process ASSIMP's root node recursively
   _processNode(scene->mRootNode, scene, material);
+
+  std::vector<CachedMesh> meshes;
+  for (const auto& mesh : _meshes) {
+    meshes.push_back(CachedMesh{
+      mesh.getVertexBuffer(), mesh.getVertexCount(), mesh.getIndexBuffer(), mesh.getTriangleCount()
+    });
+  }
+  cache->save(meshes);
 }
 
 void Model::_processNode(aiNode *node, const aiScene *scene, Material material) {
   for (unsigned int i = 0; i < node->mNumMeshes; i++) {
     aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-    auto processedMesh = _processMesh(mesh, scene, material);
-    _meshes.push_back(processedMesh);
-    _materials.insert(processedMesh.getMaterialPair());
+    _meshes.push_back(_processMesh(mesh, scene, material));
   }
 
   for (unsigned int i = 0; i < node->mNumChildren; i++) {
@@ -68,31 +93,47 @@ void Model::_processNode(aiNode *node, const aiScene *scene, Material material)
 }
 
 Mesh Model::_processMesh(aiMesh *mesh, const aiScene *scene, Material material) {
-  std::vector<Vertex> vertices;
-  std::vector<unsigned int> indices;
-  // std::vector<Texture> textures;
-
-  // walk through each of the mesh's vertices
-  for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
-    Vertex vertex;
-    glm::vec3 vector;
+  // Triangulation leaves point and line primitives as they are, they have no surface to hit
+  size_t triangleCount = 0;
+  for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
+    if (mesh->mFaces[i].mNumIndices == 3) {
+      triangleCount++;
+    }
+  }
 
-    vector.x = mesh->mVertices[i].x;
-    vector.y = mesh->mVertices[i].y;
-    vector.z = mesh->mVertices[i].z;
-    vertex.Position = vector;
+  auto processedMesh = Mesh(mesh->mNumVertices, triangleCount, material, _device);
 
-    vertices.push_back(vertex);
-  }
+  // Vertices and indices go straight from assimp into the buffers embree traces, without an intermediate copy
+  static_assert(sizeof(aiVector3D) == 3 * sizeof(float), "assimp must be built with single precision");
+  std::memcpy(processedMesh.getVertexBuffer(), mesh->mVertices, mesh->mNumVertices * sizeof(aiVector3D));
 
-  for (unsigned int i = 0; i < mesh->mNumFaces; i++)
-  {
-    aiFace face = mesh->mFaces[i];
+  auto indices = processedMesh.getIndexBuffer();
+  for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
+    const aiFace& face = mesh->mFaces[i];
 
-    for (unsigned int j = 0; j < face.mNumIndices; j++) {
-      indices.push_back(face.mIndices[j]);
+    if (face.mNumIndices == 3) {
+      indices[0] = face.mIndices[0];
+      indices[1] = face.mIndices[1];
+      indices[2] = face.mIndices[2];
+      indices += 3;
     }
   }
 
-  return Mesh(vertices, indices, material, _device);
+  return processedMesh;
+}
+
+ModelPrototype::ModelPrototype(const std::string& objectPath, RTCDevice device) {
+  // Materials are given by each instance, the ones of the prototype are never read
+  _model = std::make_shared<Model>(objectPath, Material{}, device);
+  _scene = rtcNewScene(device);
+
+  std::vector<Material> materials;
+  std::vector<glm::mat3> normalTransforms;
+  _model->commit(_scene, materials, normalTransforms);
+
+  rtcCommitScene(_scene);
+}
+
+ModelPrototype::~ModelPrototype() {
+  rtcReleaseScene(_scene);
 }
@@ -2,7 +2,6 @@
 
 #include <vector>
 #include <iostream>
-#include <unordered_map>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -10,11 +9,15 @@
 #include <embree3/rtcore.h>
 
 #include "Mesh.hpp"
+#include "MeshCache.hpp"
+
+class ModelPrototype;
 
 /// Model that represents a list of meshes used in the scene for ray tracing and path tracing
 class Model {
 public:
-  /// Contructs the model from the model file and saves the device for later use and generates meshes for it with their geometries using the device
+  /// Contructs the model from the model file, or from its mesh cache if the file did not change since the cache was
+  /// written, and saves the device for later use and generates meshes for it with their geometries using the device
   /// - Parameters:
   ///   - objectPath: path to object that will be read
   ///   - material: material for meshes inside model
@@ -36,18 +39,28 @@ public:
   ///   - vvec: vector for quad direction of plane that defines it
   Model(Material material, RTCDevice device, glm::vec3 corner, glm::vec3 uvec, glm::vec3 vvec);
 
-  /// Commits all meshes in the scene for ray tracing
-  /// - Parameter scene: scene used to commit meshes
-  void commit(RTCScene scene) const;
+  /// Creates a model placing a model file loaded once, see ModelPrototype
+  /// - Parameters:
+  ///   - prototype: model file placed by the instance
+  ///   - material: material for the meshes of the model file in this instance
+  ///   - device: device for mesh creation
+  ///   - transform: object to world transform of the instance
+  Model(std::shared_ptr<ModelPrototype> prototype, Material material, RTCDevice device, glm::mat4 transform);
 
-  /// Returns material map of geometry id and material for easy search
-  /// - Parameter scene: scene used to commit meshes
-  std::unordered_map<unsigned int, Material> getMaterialsMap() const;
+  /// Commits all meshes in the scene for ray tracing
+  /// - Parameters:
+  ///   - scene: scene used to commit meshes
+  ///   - materials: material table of the scene, receives the material of each mesh at its geometry id
+  ///   - normalTransforms: receives the normal transform of each mesh at its geometry id
+  void commit(RTCScene scene, std::vector<Material>& materials, std::vector<glm::mat3>& normalTransforms) const;
 
 private:
   RTCDevice _device;
   std::vector<Mesh> _meshes;
-  std::unordered_map<unsigned int, Material> _materials;
+  /// Cache the meshes were read from, null if the model was imported by assimp
+  std::shared_ptr<MeshCache> _meshCache;
+  /// Model file placed by the model, null unless it is an instance
+  std::shared_ptr<ModelPrototype> _prototype;
 
   void _loadModel(std::string const &path, Material material);
   void _loadPrimitive(const RTCGeometryType geometryType, glm::vec4 transform, Material material);
@@ -57,3 +70,29 @@ private:
 
   Mesh _processMesh(aiMesh *mesh, const aiScene *scene, Material material);
 };
+
+/// Model file committed once into a scene of its own. Instances place it in the scene with their own transform and
+/// material, so the triangles and the BVH of the file are stored once however many instances there are
+class ModelPrototype {
+public:
+  /// Loads the model file and commits its meshes into a new scene
+  /// - Parameters:
+  ///   - objectPath: path to object that will be read
+  ///   - device: device used to generate the geometries
+  ModelPrototype(const std::string& objectPath, RTCDevice device);
+
+  ~ModelPrototype();
+
+  ModelPrototype(const ModelPrototype&) = delete;
+  ModelPrototype& operator=(const ModelPrototype&) = delete;
+
+  /// Returns the committed scene with the meshes of the model file
+  RTCScene getScene() const {
+    return _scene;
+  }
+
+private:
+  RTCScene _scene;
+  /// Kept so meshes read in place from a mesh cache stay valid
+  std::shared_ptr<Model> _model;
+};
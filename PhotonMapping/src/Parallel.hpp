@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Rectangular region of the image rendered as a single unit of work
+struct Tile {
+  unsigned int x0, y0;
+  unsigned int x1, y1;
+};
+
+/// Returns the number of worker threads used by the parallel loops
+inline unsigned int hardwareThreadCount() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/// Runs the task for every index in [0, count) on all hardware threads.
+/// Workers pull the next index from a shared counter, so threads that finish cheap items early keep taking work
+/// instead of idling while a slow one finishes its static share.
+/// - Parameters:
+///   - count: number of work items
+///   - task: callable receiving the item index
+///   - threadCount: number of workers, 0 uses every hardware thread
+inline void parallelFor(size_t count, const std::function<void(size_t)>& task, unsigned int threadCount = 0) {
+  if (threadCount == 0) {
+    threadCount = hardwareThreadCount();
+  }
+  threadCount = (unsigned int)std::min<size_t>(threadCount, count);
+
+  if (threadCount <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      task(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next{ 0 };
+  std::exception_ptr error;
+  std::mutex errorMutex;
+
+  auto worker = [&]() {
+    try {
+      for (size_t i = next++; i < count; i = next++) {
+        task(i);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      next = count;
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(threadCount - 1);
+  for (unsigned int i = 1; i < threadCount; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/// Splits an image in square tiles, the last row and column of tiles are clipped to the image size
+/// - Parameters:
+///   - width: horizontal size for the image
+///   - height: vertical size for the image
+///   - tileSize: side of each tile in pixels
+inline std::vector<Tile> makeTiles(unsigned int width, unsigned int height, unsigned int tileSize) {
+  std::vector<Tile> tiles;
+
+  for (unsigned int y = 0; y < height; y += tileSize) {
+    for (unsigned int x = 0; x < width; x += tileSize) {
+      tiles.push_back(Tile{ x, y, std::min(x + tileSize, width), std::min(y + tileSize, height) });
+    }
+  }
+
+  return tiles;
+}
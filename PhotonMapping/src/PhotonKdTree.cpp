@@ -0,0 +1,378 @@
+#include "PhotonKdTree.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+#include <glm/gtx/norm.hpp>
+
+#include "BinaryFile.hpp"
+#include "Parallel.hpp"
+
+/// Identifies photon map files, followed by the format version. Increase the version whenever the header, the node or
+/// the photon layout change, old files are then rejected instead of being read with the wrong layout
+constexpr char photonMapMagic[8] = { 'P', 'H', 'O', 'T', 'O', 'N', 'M', 'P' };
+constexpr uint32_t photonMapVersion = 2;
+
+/// First bytes of a photon map file. Offsets are from the start of the file
+struct PhotonMapFileHeader {
+  char magic[8];
+  uint32_t version;
+  PhotonStorage storage;
+  uint64_t count;
+  uint64_t nodeCount;
+  /// Sizes of the records when the file was written, files from builds with another layout are rejected
+  uint32_t nodeSize;
+  uint32_t photonSize;
+  uint32_t leafCapacity;
+  BoundingBox bounds;
+  uint64_t nodesOffset;
+  /// Coordinate arrays hold count + leafCapacity elements
+  uint64_t xOffset;
+  uint64_t yOffset;
+  uint64_t zOffset;
+  uint64_t photonsOffset;
+};
+
+/// Stores the photon in the slot of the tree given in the format of the tree
+static void storePhoton(
+  const PhotonHit& photon, std::vector<PhotonHit>& photons, std::vector<CompactPhoton>&, uint32_t index
+) {
+  photons[index] = photon;
+}
+
+static void storePhoton(
+  const CompactPhotonHit& photon, std::vector<PhotonHit>&, std::vector<CompactPhoton>& compactPhotons, uint32_t index
+) {
+  compactPhotons[index] = photon.photon;
+}
+
+/// Number of nodes of the subtrees built from count and from count + 1 photons. Nodes always split their photons in
+/// halves, so the halves of both sizes are again two consecutive sizes and the counts are found in O(log count)
+static std::pair<size_t, size_t> subtreeNodeCounts(size_t count) {
+  if (count + 1 <= photonLeafCapacity) {
+    return { 1, 1 };
+  }
+
+  auto half = count / 2;
+  auto halfCounts = subtreeNodeCounts(half);
+  auto nodeCount = [&](size_t photons) -> size_t {
+    if (photons <= photonLeafCapacity) {
+      return 1;
+    }
+    auto left = photons / 2;
+    auto right = photons - left;
+    return 1 + (left == half ? halfCounts.first : halfCounts.second) +
+      (right == half ? halfCounts.first : halfCounts.second);
+  };
+
+  return { nodeCount(count), nodeCount(count + 1) };
+}
+
+/// Photons copied into the arrays of the tree by each task of the build
+constexpr size_t photonCopyChunkSize = 1 << 16;
+
+PhotonKdTree::PhotonKdTree(const std::vector<PhotonHit>& photons, unsigned int threadCount) :
+  _storage(PhotonStorage::Full),
+  _photonBuffer(photons.size()) {
+  _build(photons, threadCount);
+  _photons = _photonBuffer.data();
+}
+
+PhotonKdTree::PhotonKdTree(const std::vector<CompactPhotonHit>& photons, unsigned int threadCount) :
+  _storage(PhotonStorage::Compact),
+  _compactPhotonBuffer(photons.size()) {
+  _build(photons, threadCount);
+  _compactPhotons = _compactPhotonBuffer.data();
+}
+
+template<typename Photon>
+void PhotonKdTree::_build(const std::vector<Photon>& photons, unsigned int threadCount) {
+  _size = photons.size();
+  _xBuffer.assign(_size + photonLeafCapacity, 0.f);
+  _yBuffer.assign(_size + photonLeafCapacity, 0.f);
+  _zBuffer.assign(_size + photonLeafCapacity, 0.f);
+
+  if (!photons.empty()) {
+    _bounds = BoundingBox{ photons[0].position, photons[0].position };
+    for (const auto& photon : photons) {
+      _bounds.min = glm::min(_bounds.min, photon.position);
+      _bounds.max = glm::max(_bounds.max, photon.position);
+    }
+
+    // The photons are sorted through indices so nth_element only moves 4 bytes per swap
+    std::vector<uint32_t> order(photons.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    // The shape of the tree only depends on the number of photons, so every subtree knows where its nodes go and
+    // subtrees are built at the same time without synchronization
+    _nodeBuffer.resize(subtreeNodeCounts(_size).first);
+
+    // The top levels are split one level at a time, each level in parallel, until there are enough subtrees to keep
+    // every thread busy. Then each subtree is built to the leaves by a single task
+    auto threads = threadCount == 0 ? hardwareThreadCount() : threadCount;
+    std::vector<PhotonKdRange> ranges{ PhotonKdRange{ 0, _size, 0 } };
+    while (!ranges.empty() && ranges.size() < 4 * (size_t)threads) {
+      std::vector<PhotonKdRange> children(2 * ranges.size());
+      std::vector<char> isInner(ranges.size());
+
+      parallelFor(ranges.size(), [&](size_t i) {
+        isInner[i] = _splitNode(photons, order, ranges[i], &children[2 * i]);
+      }, threads);
+
+      std::vector<PhotonKdRange> nextRanges;
+      for (size_t i = 0; i < ranges.size(); ++i) {
+        if (isInner[i]) {
+          nextRanges.push_back(children[2 * i]);
+          nextRanges.push_back(children[2 * i + 1]);
+        }
+      }
+      ranges = std::move(nextRanges);
+    }
+
+    parallelFor(ranges.size(), [&](size_t i) {
+      _split(photons, order, ranges[i]);
+    }, threads);
+
+    // Every leaf covers a range of order, so writing the photons in that order makes each leaf contiguous
+    parallelFor((_size + photonCopyChunkSize - 1) / photonCopyChunkSize, [&](size_t chunk) {
+      auto last = std::min(_size, (chunk + 1) * photonCopyChunkSize);
+      for (size_t i = chunk * photonCopyChunkSize; i < last; ++i) {
+        const auto& photon = photons[order[i]];
+        _xBuffer[i] = photon.position.x;
+        _yBuffer[i] = photon.position.y;
+        _zBuffer[i] = photon.position.z;
+        storePhoton(photon, _photonBuffer, _compactPhotonBuffer, (uint32_t)i);
+      }
+    }, threads);
+  }
+
+  _nodeCount = _nodeBuffer.size();
+  _nodes = _nodeBuffer.data();
+  _x = _xBuffer.data();
+  _y = _yBuffer.data();
+  _z = _zBuffer.data();
+}
+
+template<typename Photon>
+bool PhotonKdTree::_splitNode(
+  const std::vector<Photon>& photons, std::vector<uint32_t>& order, const PhotonKdRange& range,
+  PhotonKdRange* children
+) {
+  auto begin = range.begin;
+  auto end = range.end;
+
+  if (end - begin <= photonLeafCapacity) {
+    _nodeBuffer[range.node] = PhotonKdNode{ 0.f, photonLeafAxis, (uint32_t)begin, (uint32_t)(end - begin) };
+    return false;
+  }
+
+  glm::vec3 min = photons[order[begin]].position;
+  glm::vec3 max = min;
+  for (size_t i = begin + 1; i < end; ++i) {
+    min = glm::min(min, photons[order[i]].position);
+    max = glm::max(max, photons[order[i]].position);
+  }
+
+  auto extent = max - min;
+  uint32_t axis = 0;
+  if (extent.y > extent[axis]) axis = 1;
+  if (extent.z > extent[axis]) axis = 2;
+
+  auto median = begin + (end - begin) / 2;
+  std::nth_element(
+    order.begin() + begin, order.begin() + median, order.begin() + end,
+    [&photons, axis](uint32_t first, uint32_t second) {
+      return photons[first].position[axis] < photons[second].position[axis];
+    }
+  );
+
+  // Photons before the median are at or below the plane and the rest at or above it. The left subtree follows its
+  // parent and the right one starts after every node of the left one
+  auto right = range.node + 1 + (uint32_t)subtreeNodeCounts(median - begin).first;
+  _nodeBuffer[range.node] = PhotonKdNode{ photons[order[median]].position[axis], axis, right, 0 };
+
+  children[0] = PhotonKdRange{ begin, median, range.node + 1 };
+  children[1] = PhotonKdRange{ median, end, right };
+  return true;
+}
+
+template<typename Photon>
+void PhotonKdTree::_split(const std::vector<Photon>& photons, std::vector<uint32_t>& order, const PhotonKdRange& range) {
+  PhotonKdRange children[2];
+
+  if (_splitNode(photons, order, range, children)) {
+    _split(photons, order, children[0]);
+    _split(photons, order, children[1]);
+  }
+}
+
+size_t PhotonKdTree::size() const {
+  return _size;
+}
+
+PhotonStorage PhotonKdTree::storage() const {
+  return _storage;
+}
+
+PhotonHit PhotonKdTree::photon(uint32_t index) const {
+  if (_storage == PhotonStorage::Compact) {
+    return expandPhoton(_compactPhotons[index], position(index));
+  }
+
+  return _photons[index];
+}
+
+BoundingBox PhotonKdTree::bounds() const {
+  return _bounds;
+}
+
+void PhotonKdTree::rangeSearch(glm::vec3 point, float radius, PhotonSearchContext& context) const {
+  context.result.clear();
+
+  gather(point, radius, [&context](uint32_t index, float) {
+    context.result.push_back(index);
+  });
+}
+
+void PhotonKdTree::save(const std::string& filename) const {
+  std::ofstream file(filename + ".ptree", std::ios::binary);
+
+  if (!file.is_open()) {
+    throw std::invalid_argument("PhotonKdTree::save(): could not open file");
+  }
+
+  auto photonSize = _storage == PhotonStorage::Compact ? sizeof(CompactPhoton) : sizeof(PhotonHit);
+  auto photonData = _storage == PhotonStorage::Compact ? (const char*)_compactPhotons : (const char*)_photons;
+  auto coordinatesSize = sizeof(float) * (_size + photonLeafCapacity);
+
+  PhotonMapFileHeader header{};
+  std::memcpy(header.magic, photonMapMagic, sizeof(photonMapMagic));
+  header.version = photonMapVersion;
+  header.storage = _storage;
+  header.count = _size;
+  header.nodeCount = _nodeCount;
+  header.nodeSize = sizeof(PhotonKdNode);
+  header.photonSize = (uint32_t)photonSize;
+  header.leafCapacity = photonLeafCapacity;
+  header.bounds = _bounds;
+  header.nodesOffset = alignOffset(sizeof(PhotonMapFileHeader));
+  header.xOffset = alignOffset(header.nodesOffset + sizeof(PhotonKdNode) * _nodeCount);
+  header.yOffset = alignOffset(header.xOffset + coordinatesSize);
+  header.zOffset = alignOffset(header.yOffset + coordinatesSize);
+  header.photonsOffset = alignOffset(header.zOffset + coordinatesSize);
+
+  BinaryFileWriter writer(file);
+  writer.writeSection(0, &header, sizeof(header));
+  writer.writeSection(header.nodesOffset, _nodes, sizeof(PhotonKdNode) * _nodeCount);
+  writer.writeSection(header.xOffset, _x, coordinatesSize);
+  writer.writeSection(header.yOffset, _y, coordinatesSize);
+  writer.writeSection(header.zOffset, _z, coordinatesSize);
+  writer.writeSection(header.photonsOffset, photonData, photonSize * _size);
+
+  if (!file) {
+    throw std::invalid_argument("PhotonKdTree::save(): could not write file");
+  }
+}
+
+/// Checks that traversing the nodes stays inside the arrays of the file. Children must come after their parent, which
+/// the preorder layout of the build guarantees, so a corrupted file can not make the traversal loop, and no path may
+/// be deeper than the traversal stack
+static bool areNodesValid(const PhotonKdNode* nodes, uint64_t nodeCount, uint64_t photonCount) {
+  if (photonCount > 0 && nodeCount == 0) {
+    return false;
+  }
+
+  // Depth of each node, children are always visited after every one of their parents
+  std::vector<uint8_t> depths(nodeCount, 0);
+
+  for (uint64_t i = 0; i < nodeCount; ++i) {
+    const auto& node = nodes[i];
+
+    if (node.axis > photonLeafAxis) {
+      return false;
+    }
+
+    if (node.axis == photonLeafAxis) {
+      if (node.count > photonLeafCapacity || (uint64_t)node.index + node.count > photonCount) {
+        return false;
+      }
+      continue;
+    }
+
+    if (node.index >= nodeCount || node.index <= i + 1 || depths[i] + 1u >= photonTraversalStackSize) {
+      return false;
+    }
+
+    auto childDepth = (uint8_t)(depths[i] + 1);
+    depths[i + 1] = std::max(depths[i + 1], childDepth);
+    depths[node.index] = std::max(depths[node.index], childDepth);
+  }
+
+  return true;
+}
+
+std::shared_ptr<PhotonKdTree> PhotonKdTree::load(const std::string& filename) {
+  auto file = std::make_shared<MappedFile>(filename + ".ptree");
+
+  if (file->size() < sizeof(PhotonMapFileHeader)) {
+    throw std::invalid_argument("PhotonKdTree::load(): file is truncated");
+  }
+
+  PhotonMapFileHeader header;
+  std::memcpy(&header, file->data(), sizeof(header));
+
+  if (std::memcmp(header.magic, photonMapMagic, sizeof(photonMapMagic)) != 0) {
+    throw std::invalid_argument("PhotonKdTree::load(): file is not a photon map");
+  }
+  if (header.version != photonMapVersion) {
+    throw std::invalid_argument("PhotonKdTree::load(): unsupported photon map version");
+  }
+
+  auto photonSize = header.storage == PhotonStorage::Compact ? sizeof(CompactPhoton) : sizeof(PhotonHit);
+  if (
+    (header.storage != PhotonStorage::Full && header.storage != PhotonStorage::Compact) ||
+    header.nodeSize != sizeof(PhotonKdNode) || header.photonSize != photonSize ||
+    header.leafCapacity != photonLeafCapacity
+  ) {
+    throw std::invalid_argument("PhotonKdTree::load(): photon map layout does not match this build");
+  }
+
+  auto fileSize = (uint64_t)file->size();
+  if (
+    header.count > std::numeric_limits<uint32_t>::max() - photonLeafCapacity ||
+    !isSectionValid(header.nodesOffset, header.nodeCount, sizeof(PhotonKdNode), fileSize) ||
+    !isSectionValid(header.xOffset, header.count + photonLeafCapacity, sizeof(float), fileSize) ||
+    !isSectionValid(header.yOffset, header.count + photonLeafCapacity, sizeof(float), fileSize) ||
+    !isSectionValid(header.zOffset, header.count + photonLeafCapacity, sizeof(float), fileSize) ||
+    !isSectionValid(header.photonsOffset, header.count, photonSize, fileSize)
+  ) {
+    throw std::invalid_argument("PhotonKdTree::load(): file is truncated");
+  }
+
+  if (!areNodesValid((const PhotonKdNode*)(file->data() + header.nodesOffset), header.nodeCount, header.count)) {
+    throw std::invalid_argument("PhotonKdTree::load(): photon map nodes are corrupted");
+  }
+
+  // The nodes are stored already built, so the tree is used in place without rebuilding it
+  std::shared_ptr<PhotonKdTree> tree(new PhotonKdTree());
+  tree->_storage = header.storage;
+  tree->_size = header.count;
+  tree->_nodeCount = header.nodeCount;
+  tree->_bounds = header.bounds;
+  tree->_nodes = (const PhotonKdNode*)(file->data() + header.nodesOffset);
+  tree->_x = (const float*)(file->data() + header.xOffset);
+  tree->_y = (const float*)(file->data() + header.yOffset);
+  tree->_z = (const float*)(file->data() + header.zOffset);
+  if (header.storage == PhotonStorage::Compact) {
+    tree->_compactPhotons = (const CompactPhoton*)(file->data() + header.photonsOffset);
+  } else {
+    tree->_photons = (const PhotonHit*)(file->data() + header.photonsOffset);
+  }
+  tree->_file = file;
+
+  return tree;
+}
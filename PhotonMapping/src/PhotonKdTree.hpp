@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "BoundingBox.hpp"
+#include "PhotonHit.hpp"
+#include "CompactPhoton.hpp"
+#include "MappedFile.hpp"
+#include "PhotonKernels.hpp"
+
+/// Format used to store the photons in the tree
+enum class PhotonStorage : uint32_t {
+  /// Every photon is kept as a PhotonHit
+  Full,
+  /// Photons are kept as CompactPhoton, trading precision in power and directions for less than half the memory
+  Compact
+};
+
+/// Axis value marking a leaf of the photon tree
+constexpr uint32_t photonLeafAxis = 3;
+
+/// Entries of the traversal stack. Each level of the tree pushes at most one node and leaves split photons in halves,
+/// so even a tree of 2^32 photons needs less than 32
+constexpr size_t photonTraversalStackSize = 64;
+
+/// Node of the photon tree. Inner nodes only keep the splitting plane, the photons are in the leaves
+struct PhotonKdNode {
+  /// Position of the splitting plane along axis, unused in leaves
+  float split;
+  /// Dimension (0 = x, 1 = y, 2 = z) of the plane splitting the children of the node, photonLeafAxis for leaves
+  uint32_t axis;
+  /// Inner nodes: index of the right child, the left one is the next node. Leaves: index of the first photon
+  uint32_t index;
+  /// Number of photons of a leaf, unused in inner nodes
+  uint32_t count;
+};
+
+/// Scratch state of a photon query. Owned by the caller and reused between queries, so many threads can search the
+/// same tree without locks and without allocating once the buffers are warm
+struct PhotonSearchContext {
+  /// Indices of the photons found by the last query, use PhotonKdTree::photon or PhotonKdTree::position to read them
+  std::vector<uint32_t> result;
+};
+
+/// Photon found by a nearest photons query
+struct PhotonDistance {
+  float distanceSquared;
+  uint32_t index;
+
+  bool operator<(const PhotonDistance& other) const {
+    return distanceSquared < other.distanceSquared;
+  }
+};
+
+/// Result of PhotonKdTree::nearestPhotons. It has a fixed capacity so it can live on the stack of the caller, the
+/// photons are left unsorted
+template<size_t Capacity>
+struct NearestPhotons {
+  /// Max heap by distance, the farthest photon found is the first one
+  PhotonDistance photons[Capacity];
+  size_t size = 0;
+
+  /// Squared distance to the farthest photon found, only valid when size is not 0
+  float maxDistanceSquared() const {
+    return photons[0].distanceSquared;
+  }
+};
+
+/// KD-tree specialized for photons. Each node splits along the largest dimension of the box of its subtree at the
+/// median, until at most photonLeafCapacity photons are left, which become a leaf. Nodes are stored depth first in a
+/// single array, so the left child of a node is the next one.
+/// The photons of each leaf are contiguous, with their coordinates in separate x, y and z arrays so a whole leaf is
+/// tested against the query with a single SIMD kernel (see PhotonKernels.hpp). The rest of each photon is kept in a
+/// parallel array, either full or compact, in the same order.
+/// Queries walk the nodes with an explicit stack, keeping the distance from the point to the box of each pending node
+/// so subtrees out of reach are skipped without testing their photons.
+/// A tree either owns its arrays, when it is built from photons, or reads them in place from a mapped file.
+/// This layout replaced a left-balanced heap with one photon per node and implicit children 2i+1 and 2i+2, which could
+/// only test photons one at a time. Leaves hold 8 to 16 photons, so each photon takes 12 bytes of coordinates, 52
+/// bytes of PhotonHit or 12 bytes of CompactPhoton, and 2 to 4 bytes of 16 byte nodes, about 67 or 27 bytes in all.
+class PhotonKdTree {
+public:
+  /// Builds the tree storing full photons, they can be empty. Subtrees are built in parallel
+  /// - Parameters:
+  ///   - photons: photons that will be stored in the tree
+  ///   - threadCount: threads used by the build, 0 uses every hardware thread
+  explicit PhotonKdTree(const std::vector<PhotonHit>& photons, unsigned int threadCount = 0);
+
+  /// Builds the tree storing compact photons, they can be empty. Subtrees are built in parallel
+  /// - Parameters:
+  ///   - photons: photons that will be stored in the tree
+  ///   - threadCount: threads used by the build, 0 uses every hardware thread
+  explicit PhotonKdTree(const std::vector<CompactPhotonHit>& photons, unsigned int threadCount = 0);
+
+  /// Number of photons in the tree
+  size_t size() const;
+
+  /// Format used to store the photons
+  PhotonStorage storage() const;
+
+  /// Photon stored in the index given, decoded if the tree stores compact photons
+  /// - Parameter index: index returned by a query
+  PhotonHit photon(uint32_t index) const;
+
+  /// Position of the photon stored in the index given
+  /// - Parameter index: index returned by a query
+  glm::vec3 position(uint32_t index) const;
+
+  /// Power of the photon stored in the index given, without decoding the rest of a compact photon
+  /// - Parameter index: index returned by a query
+  glm::vec3 power(uint32_t index) const;
+
+  /// Bounding box of all photons in the tree
+  BoundingBox bounds() const;
+
+  /// Calls visitor(index, distanceSquared) for every photon at a distance of at most radius from the point, in no
+  /// particular order. Nothing is allocated or copied, so estimates can be accumulated directly in the visitor
+  /// - Parameters:
+  ///   - point: center of the search
+  ///   - radius: maximum distance to the photons
+  ///   - visitor: callable receiving the index and the squared distance of each photon found
+  template<typename Visitor>
+  void gather(glm::vec3 point, float radius, Visitor&& visitor) const;
+
+  /// Finds every photon at a distance of at most radius from the point. Results are left in context.result unsorted
+  /// - Parameters:
+  ///   - point: center of the search
+  ///   - radius: maximum distance to the photons
+  ///   - context: search state of the calling thread
+  void rangeSearch(glm::vec3 point, float radius, PhotonSearchContext& context) const;
+
+  /// Finds the k photons closest to the point that are at a distance of at most maxRadius, keeping them in a bounded
+  /// max heap so the cost does not depend on how many photons are around the point
+  /// - Parameters:
+  ///   - point: center of the search
+  ///   - k: number of photons requested, clamped to Capacity
+  ///   - maxRadius: maximum distance to the photons
+  ///   - result: receives the photons found
+  template<size_t Capacity>
+  void nearestPhotons(glm::vec3 point, size_t k, float maxRadius, NearestPhotons<Capacity>& result) const;
+
+  /// Saves the built tree to the path given. The file starts with a versioned header followed by the node, coordinate
+  /// and photon arrays exactly as they are in memory, so it can be used by load without rebuilding
+  /// - Parameter filename: path of the file without extension
+  void save(const std::string& filename) const;
+
+  /// Maps a tree previously stored with save. Nothing is copied or rebuilt, the OS loads the pages the queries touch
+  /// and shares them between every process rendering with the same file.
+  /// Throws std::invalid_argument if the file is missing, truncated or written by an incompatible version
+  /// - Parameter filename: path of the file without extension
+  static std::shared_ptr<PhotonKdTree> load(const std::string& filename);
+
+  // The arrays are referenced through pointers into the tree itself, so it can not be copied or moved
+  PhotonKdTree(const PhotonKdTree&) = delete;
+  PhotonKdTree& operator=(const PhotonKdTree&) = delete;
+
+private:
+  PhotonKdTree() = default;
+
+  PhotonStorage _storage = PhotonStorage::Full;
+  size_t _size = 0;
+  size_t _nodeCount = 0;
+  const PhotonKdNode* _nodes = nullptr;
+  /// Coordinates of the photons, padded with photonLeafCapacity elements so kernels can read whole registers
+  const float* _x = nullptr;
+  const float* _y = nullptr;
+  const float* _z = nullptr;
+  const PhotonHit* _photons = nullptr;
+  const CompactPhoton* _compactPhotons = nullptr;
+  BoundingBox _bounds{ glm::vec3{ 0.f }, glm::vec3{ 0.f } };
+  PhotonLeafKernel _leafKernel = photonLeafKernel();
+
+  // Arrays of a tree built in memory, empty when the tree reads them from _file
+  std::vector<PhotonKdNode> _nodeBuffer;
+  std::vector<float> _xBuffer;
+  std::vector<float> _yBuffer;
+  std::vector<float> _zBuffer;
+  std::vector<PhotonHit> _photonBuffer;
+  std::vector<CompactPhoton> _compactPhotonBuffer;
+  std::shared_ptr<MappedFile> _file;
+
+  /// Photons [begin, end) of the build order whose subtree starts at node
+  struct PhotonKdRange {
+    size_t begin;
+    size_t end;
+    uint32_t node;
+  };
+
+  template<typename Photon>
+  void _build(const std::vector<Photon>& photons, unsigned int threadCount);
+
+  /// Writes the node of the range. Inner nodes partition the range around its median and return true, leaving the
+  /// ranges of both children in children
+  template<typename Photon>
+  bool _splitNode(
+    const std::vector<Photon>& photons, std::vector<uint32_t>& order, const PhotonKdRange& range,
+    PhotonKdRange* children
+  );
+
+  /// Builds the whole subtree of the range
+  template<typename Photon>
+  void _split(const std::vector<Photon>& photons, std::vector<uint32_t>& order, const PhotonKdRange& range);
+
+  /// Visits every leaf whose box is at most radiusSquared away from the point, calling visitLeaf(node). The leaf
+  /// visitor can shrink radiusSquared to prune the rest of the search
+  template<typename LeafVisitor>
+  void _traverse(glm::vec3 point, float& radiusSquared, LeafVisitor&& visitLeaf) const;
+};
+
+// Accessors used inside gather visitors are inline so the compiler can fold them into the traversal
+
+inline glm::vec3 PhotonKdTree::position(uint32_t index) const {
+  return glm::vec3{ _x[index], _y[index], _z[index] };
+}
+
+inline glm::vec3 PhotonKdTree::power(uint32_t index) const {
+  if (_storage == PhotonStorage::Compact) {
+    return decodeRGBE(_compactPhotons[index].power);
+  }
+
+  return _photons[index].power;
+}
+
+template<typename LeafVisitor>
+void PhotonKdTree::_traverse(glm::vec3 point, float& radiusSquared, LeafVisitor&& visitLeaf) const {
+  if (_size == 0) {
+    return;
+  }
+
+  /// Node waiting to be visited. offsets holds, per axis, the distance from the point to the box of the node, so
+  /// the squared distance of a child box is updated from its parent along a single axis instead of recomputed
+  struct PendingNode {
+    uint32_t index;
+    float distanceSquared;
+    glm::vec3 offsets;
+  };
+
+  PendingNode stack[photonTraversalStackSize];
+  size_t stackSize = 0;
+
+  auto rootOffsets = glm::max(glm::max(_bounds.min - point, point - _bounds.max), glm::vec3{ 0.f });
+  stack[stackSize++] = PendingNode{ 0, glm::dot(rootOffsets, rootOffsets), rootOffsets };
+
+  while (stackSize != 0) {
+    auto pending = stack[--stackSize];
+
+    // The radius may have shrunk since the node was pushed
+    if (pending.distanceSquared > radiusSquared) {
+      continue;
+    }
+
+    auto index = pending.index;
+    const auto* node = &_nodes[index];
+
+    // Descend to the leaf on the side of the point, pushing the far children whose box is close enough
+    while (node->axis != photonLeafAxis) {
+      auto axis = node->axis;
+      auto delta = point[axis] - node->split;
+      auto nearIndex = delta < 0.f ? index + 1 : node->index;
+      auto farIndex = delta < 0.f ? node->index : index + 1;
+
+      // Along the split axis the far box starts at the plane, which is never closer than the parent box
+      auto farDistanceSquared = pending.distanceSquared - pending.offsets[axis] * pending.offsets[axis] + delta * delta;
+      if (farDistanceSquared <= radiusSquared) {
+        auto farOffsets = pending.offsets;
+        farOffsets[axis] = std::abs(delta);
+        stack[stackSize++] = PendingNode{ farIndex, farDistanceSquared, farOffsets };
+      }
+
+      index = nearIndex;
+      node = &_nodes[index];
+    }
+
+    visitLeaf(*node);
+  }
+}
+
+template<typename Visitor>
+void PhotonKdTree::gather(glm::vec3 point, float radius, Visitor&& visitor) const {
+  auto radiusSquared = radius * radius;
+
+  _traverse(point, radiusSquared, [&](const PhotonKdNode& leaf) {
+    float distancesSquared[photonLeafCapacity];
+    auto mask = _leafKernel(
+      _x + leaf.index, _y + leaf.index, _z + leaf.index, leaf.count, point, radiusSquared, distancesSquared
+    );
+
+    while (mask != 0) {
+      auto lane = (uint32_t)std::countr_zero(mask);
+      mask &= mask - 1;
+      visitor(leaf.index + lane, distancesSquared[lane]);
+    }
+  });
+}
+
+template<size_t Capacity>
+void PhotonKdTree::nearestPhotons(glm::vec3 point, size_t k, float maxRadius, NearestPhotons<Capacity>& result) const {
+  result.size = 0;
+  k = std::min(k, Capacity);
+
+  if (k == 0) {
+    return;
+  }
+
+  // Until k photons are found the search is bounded by the maximum radius, then by the farthest photon kept
+  auto maxDistanceSquared = maxRadius * maxRadius;
+  auto photons = result.photons;
+
+  _traverse(point, maxDistanceSquared, [&](const PhotonKdNode& leaf) {
+    float distancesSquared[photonLeafCapacity];
+    auto mask = _leafKernel(
+      _x + leaf.index, _y + leaf.index, _z + leaf.index, leaf.count, point, maxDistanceSquared, distancesSquared
+    );
+
+    while (mask != 0) {
+      auto lane = (uint32_t)std::countr_zero(mask);
+      mask &= mask - 1;
+
+      // The bound may have shrunk since the kernel ran with an earlier photon of the same leaf
+      auto distanceSquared = distancesSquared[lane];
+      if (distanceSquared > maxDistanceSquared) {
+        continue;
+      }
+
+      if (result.size < k) {
+        photons[result.size++] = PhotonDistance{ distanceSquared, leaf.index + lane };
+        std::push_heap(photons, photons + result.size);
+        if (result.size == k) {
+          maxDistanceSquared = photons[0].distanceSquared;
+        }
+      } else {
+        std::pop_heap(photons, photons + result.size);
+        photons[result.size - 1] = PhotonDistance{ distanceSquared, leaf.index + lane };
+        std::push_heap(photons, photons + result.size);
+        maxDistanceSquared = photons[0].distanceSquared;
+      }
+    }
+  });
+}
@@ -0,0 +1,186 @@
+#include "PhotonKernels.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define PHOTON_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC accepts any intrinsic without flags, gcc and clang need the instruction set enabled per function so the rest
+// of the program still runs on CPUs without it
+#if defined(PHOTON_KERNELS_X86) && !defined(_MSC_VER)
+#define PHOTON_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PHOTON_TARGET(isa)
+#endif
+
+static uint32_t countMask(uint32_t count) {
+  return count >= 32 ? ~0u : (1u << count) - 1u;
+}
+
+[[maybe_unused]] static uint32_t scalarLeafKernel(
+  const float* x, const float* y, const float* z, uint32_t count, glm::vec3 point, float radiusSquared,
+  float* distancesSquared
+) {
+  uint32_t mask = 0;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    auto dx = x[i] - point.x;
+    auto dy = y[i] - point.y;
+    auto dz = z[i] - point.z;
+    distancesSquared[i] = dx * dx + dy * dy + dz * dz;
+
+    if (distancesSquared[i] <= radiusSquared) {
+      mask |= 1u << i;
+    }
+  }
+
+  return mask;
+}
+
+#ifdef PHOTON_KERNELS_X86
+
+static uint32_t sseLeafKernel(
+  const float* x, const float* y, const float* z, uint32_t count, glm::vec3 point, float radiusSquared,
+  float* distancesSquared
+) {
+  auto px = _mm_set1_ps(point.x);
+  auto py = _mm_set1_ps(point.y);
+  auto pz = _mm_set1_ps(point.z);
+  auto radius = _mm_set1_ps(radiusSquared);
+  uint32_t mask = 0;
+
+  for (uint32_t i = 0; i < count; i += 4) {
+    auto dx = _mm_sub_ps(_mm_loadu_ps(x + i), px);
+    auto dy = _mm_sub_ps(_mm_loadu_ps(y + i), py);
+    auto dz = _mm_sub_ps(_mm_loadu_ps(z + i), pz);
+    auto distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+    _mm_storeu_ps(distancesSquared + i, distance);
+    mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(distance, radius)) << i;
+  }
+
+  return mask & countMask(count);
+}
+
+PHOTON_TARGET("avx2,fma")
+static uint32_t avx2LeafKernel(
+  const float* x, const float* y, const float* z, uint32_t count, glm::vec3 point, float radiusSquared,
+  float* distancesSquared
+) {
+  auto px = _mm256_set1_ps(point.x);
+  auto py = _mm256_set1_ps(point.y);
+  auto pz = _mm256_set1_ps(point.z);
+  auto radius = _mm256_set1_ps(radiusSquared);
+  uint32_t mask = 0;
+
+  for (uint32_t i = 0; i < count; i += 8) {
+    auto dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), px);
+    auto dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), py);
+    auto dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), pz);
+    auto distance = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+
+    _mm256_storeu_ps(distancesSquared + i, distance);
+    mask |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(distance, radius, _CMP_LE_OQ)) << i;
+  }
+
+  return mask & countMask(count);
+}
+
+PHOTON_TARGET("avx512f")
+static uint32_t avx512LeafKernel(
+  const float* x, const float* y, const float* z, uint32_t count, glm::vec3 point, float radiusSquared,
+  float* distancesSquared
+) {
+  // A whole leaf fits in one register, lanes past the end of the leaf are not even loaded
+  auto lanes = (__mmask16)countMask(count);
+
+  auto dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, x), _mm512_set1_ps(point.x));
+  auto dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, y), _mm512_set1_ps(point.y));
+  auto dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, z), _mm512_set1_ps(point.z));
+  auto distance = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+
+  _mm512_storeu_ps(distancesSquared, distance);
+  return (uint32_t)_mm512_mask_cmp_ps_mask(lanes, distance, _mm512_set1_ps(radiusSquared), _CMP_LE_OQ);
+}
+
+enum class InstructionSet {
+  SSE, AVX2, AVX512
+};
+
+static InstructionSet detectInstructionSet() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  auto maxLeaf = info[0];
+
+  __cpuid(info, 1);
+  bool fma = (info[2] & (1 << 12)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  if (!osxsave || maxLeaf < 7) {
+    return InstructionSet::SSE;
+  }
+
+  // The OS must save the wide registers on context switches, otherwise the instructions can not be used
+  auto enabledState = _xgetbv(0);
+  bool avxState = (enabledState & 0x6) == 0x6;
+  bool avx512State = (enabledState & 0xe6) == 0xe6;
+
+  __cpuidex(info, 7, 0);
+  bool avx2 = (info[1] & (1 << 5)) != 0;
+  bool avx512f = (info[1] & (1 << 16)) != 0;
+
+  if (avx512f && avx512State) {
+    return InstructionSet::AVX512;
+  }
+  if (avx2 && fma && avxState) {
+    return InstructionSet::AVX2;
+  }
+  return InstructionSet::SSE;
+#else
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f")) {
+    return InstructionSet::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return InstructionSet::AVX2;
+  }
+  return InstructionSet::SSE;
+#endif
+}
+
+static InstructionSet instructionSet() {
+  static const auto detected = detectInstructionSet();
+  return detected;
+}
+
+PhotonLeafKernel photonLeafKernel() {
+  switch (instructionSet()) {
+    case InstructionSet::AVX512: return avx512LeafKernel;
+    case InstructionSet::AVX2: return avx2LeafKernel;
+    default: return sseLeafKernel;
+  }
+}
+
+const char* photonLeafKernelName() {
+  switch (instructionSet()) {
+    case InstructionSet::AVX512: return "AVX-512";
+    case InstructionSet::AVX2: return "AVX2";
+    default: return "SSE";
+  }
+}
+
+#else
+
+PhotonLeafKernel photonLeafKernel() {
+  return scalarLeafKernel;
+}
+
+const char* photonLeafKernelName() {
+  return "scalar";
+}
+
+#endif
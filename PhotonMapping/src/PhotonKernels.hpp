@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+/// Maximum number of photons in a leaf of the photon tree, one AVX-512 register, two AVX2 or four SSE ones
+constexpr uint32_t photonLeafCapacity = 16;
+
+/// Tests the photons of a leaf against a sphere. Coordinates are stored as separate x, y and z arrays, which must be
+/// readable up to photonLeafCapacity elements past the first photon even if the leaf is smaller.
+/// Returns a mask with bit i set if photon i is inside the sphere, and writes the squared distance of every photon
+/// - Parameters:
+///   - x: x coordinate of the first photon of the leaf
+///   - y: y coordinate of the first photon of the leaf
+///   - z: z coordinate of the first photon of the leaf
+///   - count: number of photons in the leaf, at most photonLeafCapacity
+///   - point: center of the sphere
+///   - radiusSquared: squared radius of the sphere
+///   - distancesSquared: receives photonLeafCapacity squared distances
+using PhotonLeafKernel = uint32_t (*)(
+  const float* x, const float* y, const float* z, uint32_t count, glm::vec3 point, float radiusSquared,
+  float* distancesSquared
+);
+
+/// Fastest leaf kernel supported by the CPU running the program, selected on the first call
+PhotonLeafKernel photonLeafKernel();
+
+/// Name of the instruction set used by photonLeafKernel, for logging
+const char* photonLeafKernelName();
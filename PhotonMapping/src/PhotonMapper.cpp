@@ -1,13 +1,21 @@
 #include "PhotonMapper.hpp"
 
 #include <glm/gtc/random.hpp>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 
 #include "EmbreeWrapper.hpp"
 #include "Constants.hpp"
 #include "Image.hpp"
+#include "Parallel.hpp"
+#include "ProcessMemory.hpp"
 #include "Utils.hpp"
 
+/// Photons shot by a single unit of work. Chunks are the unit of reproducibility, so this must not depend on the
+/// number of threads
+constexpr unsigned int photonChunkSize = 4096;
+
 PhotonMapper::PhotonMapper() {
 }
 
@@ -40,29 +48,19 @@ glm::vec3 randomNormalizedVector2() {
 }
 
 void PhotonMapper::makeMap(const Camera& camera) const {
-  auto image = Image(2000, 2000);
-  auto causticsImage = Image(4000, 4000);
-  auto depthImage = Image(4000, 4000);
-
-  if (BOOL_CONSTANTS[SHOULD_PRINT_HIT_PHOTON_MAP] || BOOL_CONSTANTS[SHOULD_PRINT_DEPTH_PHOTON_MAP]) {
-    for (auto hit : _hits) {
-      Kdtree::KdNodeVector* neighbors = new std::vector<Kdtree::KdNode>();
-
-      _tree->k_nearest_neighbors(
-                                 std::vector{
-                                   hit.position.x,
-                                   hit.position.y,
-                                   hit.position.z
-                                 }, 1, neighbors
-                                 );
-
-        //    if (hit.power.r > 0.9f && hit.power.g > 0.9f && hit.power.b > 0.9f) {
+  const auto& settings = _scene->getSettings();
+  auto image = Image(2000, 2000, settings.gammaCorrection);
+  auto causticsImage = Image(4000, 4000, settings.gammaCorrection);
+  auto depthImage = Image(4000, 4000, settings.gammaCorrection);
+
+  if (_tree && (settings.shouldPrintHitPhotonMap || settings.shouldPrintDepthPhotonMap)) {
+    for (uint32_t index = 0; index < _tree->size(); index++) {
+      auto photon = _tree->photon(index);
+
+        //    if (photon.power.r > 0.9f && photon.power.g > 0.9f && photon.power.b > 0.9f) {
         //      continue;
         //    }
 
-      Kdtree::KdNode node = neighbors->at(0);
-      auto photon = node.data;
-
       auto cameraPointPosition = camera.getProjectionMatrix() * camera.getViewMatrix() * glm::vec4(photon.position, 1.f);
 
       auto u = image.width - ((cameraPointPosition.x * image.width) / (2.f * cameraPointPosition.w) + image.width / 2.f);
@@ -72,46 +70,32 @@ void PhotonMapper::makeMap(const Camera& camera) const {
         continue;
       }
 
-      if (BOOL_CONSTANTS[SHOULD_PRINT_HIT_PHOTON_MAP])
+      if (settings.shouldPrintHitPhotonMap)
         image.writePixel((unsigned int)u, (unsigned int)v, photon.power);
 
-      if (BOOL_CONSTANTS[SHOULD_PRINT_DEPTH_PHOTON_MAP])
+      if (settings.shouldPrintDepthPhotonMap)
         depthImage.writePixel((unsigned int)u, (unsigned int)v, glm::vec3 { photon.depth * 40.f });
-
-      delete neighbors;
     }
 
-    if (BOOL_CONSTANTS[SHOULD_PRINT_HIT_PHOTON_MAP]) {
+    if (settings.shouldPrintHitPhotonMap) {
       image.save("photon-hits.jpeg");
       std::cout << "Saved photon-hits.jpeg" << std::endl;
     }
 
-    if (BOOL_CONSTANTS[SHOULD_PRINT_DEPTH_PHOTON_MAP]) {
+    if (settings.shouldPrintDepthPhotonMap) {
       depthImage.save("photon-hits-depth.jpeg");
       std::cout << "Saved photon-hits-depth.jpeg" << std::endl;
     }
   }
 
-  if (BOOL_CONSTANTS[SHOULD_PRINT_CAUSTICS_HIT_PHOTON_MAP]) {
-    for (auto hit : _caustic_hits) {
+  if (settings.shouldPrintCausticsHitPhotonMap) {
+    for (uint32_t index = 0; index < _caustics_tree->size(); index++) {
+      auto photon = _caustics_tree->photon(index);
 
-      Kdtree::KdNodeVector* caustic_neighbors = new std::vector<Kdtree::KdNode>();
-
-      _caustics_tree->k_nearest_neighbors(
-        std::vector{
-          hit.position.x,
-          hit.position.y,
-          hit.position.z
-        }, 1, caustic_neighbors
-      );
-
-  //    if (hit.power.r > 0.9f && hit.power.g > 0.9f && hit.power.b > 0.9f) {
+  //    if (photon.power.r > 0.9f && photon.power.g > 0.9f && photon.power.b > 0.9f) {
   //      continue;
   //    }
 
-      Kdtree::KdNode node = caustic_neighbors->at(0);
-      auto photon = node.data;
-
       auto cameraPointPosition = camera.getProjectionMatrix() * camera.getViewMatrix() * glm::vec4(photon.position, 1.f);
 
       auto u = causticsImage.width - ((cameraPointPosition.x * causticsImage.width) / (2.f * cameraPointPosition.w) + causticsImage.width / 2.f);
@@ -122,8 +106,6 @@ void PhotonMapper::makeMap(const Camera& camera) const {
       }
 
       causticsImage.writePixel((unsigned int)u, (unsigned int)v, photon.power);
-
-      delete caustic_neighbors;
     }
 
     causticsImage.save("caustics-photon-hits.jpeg");
@@ -136,53 +118,132 @@ void PhotonMapper::useScene(std::shared_ptr<Scene> scene) {
 }
 
 void PhotonMapper::makeGlobalPhotonMap(PhotonMap map) {
-  auto lights = _scene->getLights();
-  auto photonsPerLight = INT_CONSTANTS[PHOTON_LIMIT] / lights.size();
-  
-  for (auto light : lights) {
-    for (unsigned int i = 0; i < photonsPerLight; i++) {
-      // TODO: We know we won't manage disperse scenes, so let's only generate photons with directions to elements in the scene
-      auto direction = randomNormalizedVector();
+  auto buffer = _emitGlobalPhotons(0, nullptr);
+  _tree = _buildTree(buffer, "global", 0);
+}
 
-      auto position = light->getPosition();
+void PhotonMapper::makeCausticsPhotonMap(PhotonMap map) {
+  auto buffer = _emitCausticsPhotons();
+  _caustics_tree = _buildTree(buffer, "caustics", 0);
+}
 
-      _shootPhoton(position, direction, light->color * (FLOAT_CONSTANTS[TOTAL_LIGHT] / (float) photonsPerLight), 0, false, false);
+void PhotonMapper::makePhotonMaps() {
+  auto globalBuffer = _emitGlobalPhotons(0, nullptr);
+  auto causticsBuffer = _emitCausticsPhotons();
+
+  // Each tree is built in parallel too, so both share the hardware threads instead of oversubscribing them
+  auto threadCount = std::max(1u, hardwareThreadCount() / 2);
+  parallelFor(2, [&](size_t map) {
+    if (map == 0) {
+      _tree = _buildTree(globalBuffer, "global", threadCount);
+    } else {
+      _caustics_tree = _buildTree(causticsBuffer, "caustics", threadCount);
     }
-  }
+  }, 2);
 
-  _tree = std::make_shared<Kdtree::KdTree>(&_nodes);
+  std::cout << "Peak memory: " << peakMemoryUsage() / (1024 * 1024) << " MB" << std::endl;
 }
 
-void PhotonMapper::makeCausticsPhotonMap(PhotonMap map) {
-  auto lights = _scene->getLights();
+std::shared_ptr<PhotonKdTree> PhotonMapper::makeGlobalPhotonBatch(unsigned int batch) const {
+  auto buffer = _emitGlobalPhotons(batch, nullptr);
+  return _buildTree(buffer, "global batch", 0);
+}
+
+void PhotonMapper::splatGlobalPhotonBatch(unsigned int batch, ProgressiveEstimate& estimate) const {
+  _emitGlobalPhotons(batch, &estimate);
+}
+
+PhotonMapper::PhotonBuffer PhotonMapper::_emitGlobalPhotons(unsigned int batch, ProgressiveEstimate* splatTarget) const {
+  const auto& settings = _scene->getSettings();
+  auto photonsPerLight = (unsigned int)(settings.photonLimit / _scene->getLights().size());
+  auto power = settings.totalLight / (float) photonsPerLight;
+
+  return _emitPhotons(photonsPerLight, false, batch, splatTarget, [&](const Light& light) {
+    // TODO: We know we won't manage disperse scenes, so let's only generate photons with directions to elements in the scene
+    auto direction = randomNormalizedVector();
+
+    auto position = light.getPosition();
+
+    return PhotonPath{ position, direction, light.color * power, 0, false };
+  });
+}
+
+PhotonMapper::PhotonBuffer PhotonMapper::_emitCausticsPhotons() const {
   auto transparentBoundingBoxes = _scene->getTransparentBoundingBoxes();
-  auto photonsPerLight = INT_CONSTANTS[PHOTON_LIMIT] / lights.size();
-  
-  for (auto light : lights) {
-    for (unsigned int i = 0; i < photonsPerLight; i++) {
-      auto boundingBox = transparentBoundingBoxes.at(rand() % transparentBoundingBoxes.size());
-
-      auto position = light->getPosition();
-      auto minDirection = boundingBox->min - position;
-      auto maxDirection = boundingBox->max - position;
-      auto randomX = generalRand(minDirection.x, maxDirection.x);
-      auto randomY = generalRand(minDirection.y, maxDirection.y);
-      auto randomZ = generalRand(minDirection.z, maxDirection.z);
-      auto direction = glm::normalize(glm::vec3(randomX, randomY, randomZ));
-
-      _shootPhoton(position, direction, light->color * (FLOAT_CONSTANTS[TOTAL_LIGHT] / ((float) photonsPerLight * 70.f)), 0, true, false);
+  const auto& settings = _scene->getSettings();
+  auto photonsPerLight = (unsigned int)(settings.photonLimit / _scene->getLights().size());
+  auto power = settings.totalLight / ((float) photonsPerLight * 70.f);
+
+  return _emitPhotons(photonsPerLight, true, 0, nullptr, [&](const Light& light) {
+    auto boundingBox = transparentBoundingBoxes.at(randomIndex(transparentBoundingBoxes.size()));
+
+    auto position = light.getPosition();
+    auto minDirection = boundingBox->min - position;
+    auto maxDirection = boundingBox->max - position;
+    auto randomX = generalRand(minDirection.x, maxDirection.x);
+    auto randomY = generalRand(minDirection.y, maxDirection.y);
+    auto randomZ = generalRand(minDirection.z, maxDirection.z);
+    auto direction = glm::normalize(glm::vec3(randomX, randomY, randomZ));
+
+    return PhotonPath{ position, direction, light.color * power, 0, false };
+  });
+}
+
+PhotonMapper::PhotonBuffer PhotonMapper::_emitPhotons(
+  unsigned int photonsPerLight, bool isCausticMode, unsigned int batch, ProgressiveEstimate* splatTarget,
+  const std::function<PhotonPath(const Light&)>& emit
+) const {
+  auto lights = _scene->getLights();
+  auto chunksPerLight = (photonsPerLight + photonChunkSize - 1) / photonChunkSize;
+  std::vector<PhotonBuffer> chunks(lights.size() * chunksPerLight);
+  for (auto& chunk : chunks) {
+    chunk.splatTarget = splatTarget;
+  }
+
+  parallelFor(chunks.size(), [&](size_t chunk) {
+    const auto& light = *lights[chunk / chunksPerLight];
+    auto first = (unsigned int)(chunk % chunksPerLight) * photonChunkSize;
+    auto last = std::min(first + photonChunkSize, photonsPerLight);
+
+    seedThreadSampler(
+      _scene->getSettings().seed, isCausticMode ? SampleStream::CausticPhotons : SampleStream::GlobalPhotons,
+      (uint64_t)batch * chunks.size() + chunk
+    );
+
+    thread_local std::vector<PhotonPath> paths;
+    paths.clear();
+    for (auto i = first; i < last; i++) {
+      paths.push_back(emit(light));
     }
+
+    _tracePhotonPaths(paths, isCausticMode, chunks[chunk]);
+  });
+
+  size_t hitCount = 0;
+  size_t compactHitCount = 0;
+  for (const auto& chunk : chunks) {
+    hitCount += chunk.hits.size();
+    compactHitCount += chunk.compactHits.size();
+  }
+
+  PhotonBuffer buffer;
+  buffer.hits.reserve(hitCount);
+  buffer.compactHits.reserve(compactHitCount);
+  for (auto& chunk : chunks) {
+    buffer.hits.insert(buffer.hits.end(), chunk.hits.begin(), chunk.hits.end());
+    buffer.compactHits.insert(buffer.compactHits.end(), chunk.compactHits.begin(), chunk.compactHits.end());
+    chunk = PhotonBuffer{};
   }
 
-  _caustics_tree = std::make_shared<Kdtree::KdTree>(&_caustic_nodes);
+  return buffer;
 }
 
 void PhotonMapper::initializeTreeFromFile(std::string photonsTreeFilename, std::string causticsTreeFilename) {
   std::cout << "Loading photon map from file " << photonsTreeFilename << std::endl;
   std::cout << "Loading caustics photon map from file " << causticsTreeFilename << std::endl;
 
-  std::shared_ptr<Kdtree::KdTree> tree(Kdtree::KdTree::load(photonsTreeFilename));
-  std::shared_ptr<Kdtree::KdTree> causticsTree(Kdtree::KdTree::load(causticsTreeFilename));
+  auto tree = PhotonKdTree::load(photonsTreeFilename);
+  auto causticsTree = PhotonKdTree::load(causticsTreeFilename);
 
   std::cout << "Loaded photon map from file " << photonsTreeFilename << std::endl;
   std::cout << "Loaded caustics photon map from file " << causticsTreeFilename << std::endl;
@@ -200,14 +261,45 @@ void PhotonMapper::saveTreeToFile(std::string photonsTreeFilename, std::string c
   std::cout << "Saved caustics photon map from file " << causticsTreeFilename << std::endl;
 }
 
-void PhotonMapper::_shootPhoton(const glm::vec3 origin, const glm::vec3 direction,
-                                const glm::vec3 power, unsigned int depth, bool isCausticMode, bool in) {
-  auto rayIntersection = intersectRay(origin, direction, _scene);
+void PhotonMapper::_tracePhotonPaths(std::vector<PhotonPath>& paths, bool isCausticMode, PhotonBuffer& buffer) const {
+  auto epsilon = _scene->getSettings().epsilon;
 
-  if (!rayIntersection.has_value()) {
-    return;
+  thread_local std::vector<RTCRayHit> rayHits;
+  thread_local std::vector<PhotonPath> nextPaths;
+
+  // Every bounce of all the paths is traced with a single stream call. Paths are processed in order, so the random
+  // numbers each one draws do not depend on how Embree schedules the rays
+  while (!paths.empty()) {
+    rayHits.resize(paths.size());
+    for (size_t path = 0; path < paths.size(); ++path) {
+      rayHits[path] = rtcRayFrom(paths[path].origin, paths[path].direction, epsilon);
+    }
+
+    intersectRayStream(rayHits.data(), rayHits.size(), _scene);
+
+    nextPaths.clear();
+    for (size_t path = 0; path < paths.size(); ++path) {
+      if (rayHits[path].hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+        continue;
+      }
+
+      _scatterPhoton(paths[path], intersectionFromRayHit(rayHits[path], _scene), isCausticMode, buffer, nextPaths);
+    }
+
+    std::swap(paths, nextPaths);
   }
-  auto intersection = rayIntersection.value();
+}
+
+void PhotonMapper::_scatterPhoton(
+  const PhotonPath& path, const Intersection& intersection, bool isCausticMode, PhotonBuffer& buffer,
+  std::vector<PhotonPath>& nextPaths
+) const {
+  const auto& settings = _scene->getSettings();
+  auto epsilon = settings.epsilon;
+  const auto& power = path.power;
+  auto depth = path.depth;
+  auto in = path.in;
+
   auto photonHit = PhotonHit{
     intersection.position,
     intersection.normal,
@@ -216,15 +308,24 @@ void PhotonMapper::_shootPhoton(const glm::vec3 origin, const glm::vec3 directio
     depth
   };
 
-  auto diffuseThreshold = intersection.material.diffuseMaxPower(power);
-  auto reflectionThreshold = diffuseThreshold + intersection.material.specularMaxPower(power);
-  auto transparencyThreshold = reflectionThreshold + intersection.material.transparencyMaxPower(power);
+  // Paths past the maximum depth are dropped, which also ends photons trapped inside transparent objects
+  auto continuePath = [&](glm::vec3 origin, glm::vec3 direction, glm::vec3 newPower, bool newIn) {
+    if (depth + 1 <= settings.maxPhotonDepth) {
+      nextPaths.push_back(PhotonPath{ origin, direction, newPower, depth + 1, newIn });
+    }
+  };
+
+  // Russian roulette: the photon is diffusely reflected, specularly reflected, transmitted or absorbed with the
+  // probability of each, keeping its power instead of splitting it
+  auto diffuseThreshold = intersection.material->diffuseMaxPower(power);
+  auto reflectionThreshold = diffuseThreshold + intersection.material->specularMaxPower(power);
+  auto transparencyThreshold = reflectionThreshold + intersection.material->transparencyMaxPower(power);
 
   auto randomSample = rand01();
 
   if (randomSample <= diffuseThreshold) {
     if (depth != 0) {
-      _addHit(photonHit, isCausticMode);
+      _addHit(photonHit, buffer);
     }
 
     if (!isCausticMode) {
@@ -234,16 +335,16 @@ void PhotonMapper::_shootPhoton(const glm::vec3 origin, const glm::vec3 directio
         reflectionDirection = -reflectionDirection;
       }
 
-      auto reflectionPosition = intersection.position + FLOAT_CONSTANTS[EPSILON] * reflectionDirection;
+      auto reflectionPosition = intersection.position + epsilon * reflectionDirection;
 
-      _shootPhoton(reflectionPosition, reflectionDirection, intersection.material.diffusePower(power), depth + 1, isCausticMode, in);
+      continuePath(reflectionPosition, reflectionDirection, intersection.material->diffusePower(power), in);
     }
   } else if (randomSample <= reflectionThreshold) {
     if (!isCausticMode) {
       auto reflectionDirection = glm::reflect(intersection.direction, intersection.normal);
-      auto reflectionPosition = intersection.position + FLOAT_CONSTANTS[EPSILON] * reflectionDirection;
+      auto reflectionPosition = intersection.position + epsilon * reflectionDirection;
 
-      _shootPhoton(reflectionPosition, reflectionDirection, intersection.material.specularPower(power), depth + 1, isCausticMode, in);
+      continuePath(reflectionPosition, reflectionDirection, intersection.material->specularPower(power), in);
     }
   } else if (randomSample <= transparencyThreshold || in) {
     if (isCausticMode) {
@@ -256,9 +357,9 @@ void PhotonMapper::_shootPhoton(const glm::vec3 origin, const glm::vec3 directio
       }
 
       if (in) {
-        nuIt = intersection.material.refractionIndex / 1.0;
+        nuIt = intersection.material->refractionIndex / 1.0;
       } else {
-        nuIt = 1.0 / intersection.material.refractionIndex;
+        nuIt = 1.0 / intersection.material->refractionIndex;
       }
 
       float Ci = cosTita;
@@ -267,33 +368,43 @@ void PhotonMapper::_shootPhoton(const glm::vec3 origin, const glm::vec3 directio
       if (discriminant < 0) {
         return; //Total Internal Reflection case
       }
-      else {
-        glm::vec3 refractionDirection = nuIt * intersection.direction + (Ci * nuIt - sqrtf(discriminant)) * normal;
-        auto refractionPosition = intersection.position + FLOAT_CONSTANTS[EPSILON] * refractionDirection;
-        _shootPhoton(intersection.position, refractionDirection, intersection.material.transparencyPower(power), depth + 1, isCausticMode, !in);
-      }
+
+      glm::vec3 refractionDirection = nuIt * intersection.direction + (Ci * nuIt - sqrtf(discriminant)) * normal;
+      continuePath(intersection.position, refractionDirection, intersection.material->transparencyPower(power), !in);
     }
   } else if (depth != 0) {
-    _addHit(photonHit, isCausticMode);
+    _addHit(photonHit, buffer);
   }
 }
 
-void PhotonMapper::_addHit(PhotonHit photonHit, bool isCausticMode) {
-  auto node = Kdtree::KdNode {
-    std::vector {
-      photonHit.position.x,
-      photonHit.position.y,
-      photonHit.position.z
-    },
-    photonHit
-  };
-  if (isCausticMode) {
-    _caustic_hits.push_back(photonHit);
+void PhotonMapper::_addHit(PhotonHit photonHit, PhotonBuffer& buffer) const {
+  if (buffer.splatTarget != nullptr) {
+    buffer.splatTarget->splat(photonHit);
+    return;
+  }
 
-    _caustic_nodes.push_back(node);
+  if (_scene->getSettings().compactPhotons) {
+    buffer.compactHits.push_back(CompactPhotonHit{ photonHit.position, compactPhoton(photonHit) });
   } else {
-    _hits.push_back(photonHit);
-
-    _nodes.push_back(node);
+    buffer.hits.push_back(photonHit);
   }
 }
+
+std::shared_ptr<PhotonKdTree> PhotonMapper::_buildTree(
+  PhotonBuffer& buffer, const char* name, unsigned int threadCount
+) const {
+  auto start = std::chrono::steady_clock::now();
+
+  auto tree = _scene->getSettings().compactPhotons ?
+    std::make_shared<PhotonKdTree>(buffer.compactHits, threadCount) :
+    std::make_shared<PhotonKdTree>(buffer.hits, threadCount);
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+  // The tree keeps its own copy of the photons, so the hits are released to lower the peak memory
+  buffer = PhotonBuffer{};
+
+  std::cout << "Built " << name << " photon map of " << tree->size() << " photons in " << elapsed.count() << "ms" << std::endl;
+
+  return tree;
+}
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 
 #include "Light.hpp"
 #include "Scene.hpp"
-#include "KDTree.hpp"
+#include "PhotonKdTree.hpp"
 #include "PhotonHit.hpp"
+#include "Intersection.hpp"
+#include "ProgressiveEstimate.hpp"
 
 enum PhotonMap {
   Caustics, Global, Volumetric
@@ -21,13 +24,29 @@ public:
 
   void makeCausticsPhotonMap(PhotonMap map);
 
+  /// Shoots the photons of the global and caustics maps, then builds both trees at the same time. Prints the build
+  /// time of each tree and the peak memory of the process
+  void makePhotonMaps();
+
+  /// Shoots PHOTON_LIMIT global photons and returns them in a tree without keeping them, for the progressive mode.
+  /// Each batch draws different random numbers
+  /// - Parameter batch: index of the batch
+  std::shared_ptr<PhotonKdTree> makeGlobalPhotonBatch(unsigned int batch) const;
+
+  /// Shoots PHOTON_LIMIT global photons splatting each hit into the estimate as soon as it is found, so no photon is
+  /// stored. Call ProgressiveEstimate::addSplattedPhotons afterwards to end the batch
+  /// - Parameters:
+  ///   - batch: index of the batch
+  ///   - estimate: estimate with splatting enabled
+  void splatGlobalPhotonBatch(unsigned int batch, ProgressiveEstimate& estimate) const;
+
   void makeMap(const Camera& camera) const;
 
-  std::shared_ptr<Kdtree::KdTree> getTree() {
+  std::shared_ptr<PhotonKdTree> getTree() {
     return _tree;
   }
 
-  std::shared_ptr<Kdtree::KdTree> getCausticsTree() {
+  std::shared_ptr<PhotonKdTree> getCausticsTree() {
     return _caustics_tree;
   }
 
@@ -35,17 +54,74 @@ public:
 
   void saveTreeToFile(std::string photonsTreeFilename, std::string causticsTreeFilename) const;
 private:
-  std::shared_ptr<Kdtree::KdTree> _tree;
-  std::shared_ptr<Kdtree::KdTree> _caustics_tree;
-  Kdtree::KdNodeVector _nodes;
-  Kdtree::KdNodeVector _caustic_nodes;
+  std::shared_ptr<PhotonKdTree> _tree;
+  std::shared_ptr<PhotonKdTree> _caustics_tree;
 
   std::shared_ptr<Scene> _scene;
 
-  void _shootPhoton(const glm::vec3 origin, const glm::vec3 direction, const glm::vec3 power, unsigned int depth, bool isCausticMode, bool in);
-
-  void _addHit(PhotonHit photonHit, bool isCausticMode);
-
-  std::vector<PhotonHit> _hits;
-  std::vector<PhotonHit> _caustic_hits;
+  /// Photon travelling between two bounces
+  struct PhotonPath {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    glm::vec3 power;
+    /// Bounces so far, 0 when leaving the light
+    unsigned int depth;
+    /// Whether the photon travels inside a transparent object
+    bool in;
+  };
+
+  /// Hits collected while shooting photons, only one of the full or compact lists is used depending on COMPACT_PHOTONS.
+  /// With a splat target the hits are added to it as they are found and nothing is kept
+  struct PhotonBuffer {
+    std::vector<PhotonHit> hits;
+    std::vector<CompactPhotonHit> compactHits;
+    ProgressiveEstimate* splatTarget = nullptr;
+  };
+
+  /// Shoots photonsPerLight photons from every light in parallel and returns their hits.
+  /// Photons are split in fixed chunks, each with its own random stream and buffer, and the buffers are merged in
+  /// chunk order, so the hits only depend on the seed and not on the number of threads
+  /// - Parameters:
+  ///   - photonsPerLight: photons shot from each light
+  ///   - isCausticMode: selects the random streams, so both maps draw different numbers
+  ///   - batch: selects the random streams, so every batch of the progressive mode draws different numbers
+  ///   - splatTarget: estimate receiving the hits instead of the buffers, or null
+  ///   - emit: returns a photon leaving the light
+  PhotonBuffer _emitPhotons(
+    unsigned int photonsPerLight, bool isCausticMode, unsigned int batch, ProgressiveEstimate* splatTarget,
+    const std::function<PhotonPath(const Light&)>& emit
+  ) const;
+
+  PhotonBuffer _emitGlobalPhotons(unsigned int batch, ProgressiveEstimate* splatTarget) const;
+
+  PhotonBuffer _emitCausticsPhotons() const;
+
+  /// Traces the paths until every photon is stored, absorbed, lost or past MAX_PHOTON_DEPTH. All paths advance one
+  /// bounce at a time, so each bounce is intersected with a single stream call
+  /// - Parameters:
+  ///   - paths: photons leaving the lights, emptied by the call
+  ///   - isCausticMode: whether only photons refracted by transparent objects are followed
+  ///   - buffer: receives the photon hits
+  void _tracePhotonPaths(std::vector<PhotonPath>& paths, bool isCausticMode, PhotonBuffer& buffer) const;
+
+  /// Stores the photon at the intersection if it lands on a diffuse surface and chooses its next bounce
+  /// - Parameters:
+  ///   - path: photon arriving at the intersection
+  ///   - intersection: point hit by the photon
+  ///   - isCausticMode: whether only photons refracted by transparent objects are followed
+  ///   - buffer: receives the photon hit
+  ///   - nextPaths: receives the bounced photon, if it continues
+  void _scatterPhoton(
+    const PhotonPath& path, const Intersection& intersection, bool isCausticMode, PhotonBuffer& buffer,
+    std::vector<PhotonPath>& nextPaths
+  ) const;
+
+  void _addHit(PhotonHit photonHit, PhotonBuffer& buffer) const;
+
+  /// Builds a tree from the hits of the buffer, releasing them, and prints how long it took
+  /// - Parameters:
+  ///   - buffer: hits of the map
+  ///   - name: name of the map in the log
+  ///   - threadCount: threads used by the build, 0 uses every hardware thread
+  std::shared_ptr<PhotonKdTree> _buildTree(PhotonBuffer& buffer, const char* name, unsigned int threadCount) const;
 };
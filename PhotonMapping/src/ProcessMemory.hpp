@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+
+/// Largest amount of physical memory used by the process since it started, in bytes. Returns 0 if the platform does
+/// not report it
+size_t peakMemoryUsage();
@@ -0,0 +1,163 @@
+#include "ProgressiveEstimate.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Constants.hpp"
+#include "Parallel.hpp"
+
+/// Fraction of the new photons kept by each batch, lower values shrink the radius faster
+constexpr float progressiveAlpha = 0.7f;
+/// Minimum cosine between the normals of a photon and of a visible point for the photon to count
+constexpr float progressiveNormalCosine = 0.9f;
+/// Visible points updated by each task
+constexpr size_t progressiveChunkSize = 1024;
+
+ProgressiveEstimate::ProgressiveEstimate(std::vector<VisiblePoint> points, float initialRadius) :
+  _points(std::move(points)),
+  _statistics(_points.size(), Statistics{ initialRadius * initialRadius, 0.f, glm::vec3{ 0.f } }) {
+}
+
+void ProgressiveEstimate::addPhotons(const PhotonKdTree& photons) {
+  // Every point only writes its own statistics, so points are updated in parallel without synchronization
+  parallelFor((_points.size() + progressiveChunkSize - 1) / progressiveChunkSize, [&](size_t chunk) {
+    auto last = std::min(_points.size(), (chunk + 1) * progressiveChunkSize);
+
+    for (size_t index = chunk * progressiveChunkSize; index < last; ++index) {
+      const auto& point = _points[index];
+      const auto& statistics = _statistics[index];
+
+      float newPhotons = 0.f;
+      glm::vec3 newFlux{ 0.f };
+      photons.gather(point.position, std::sqrt(statistics.radiusSquared), [&](uint32_t photon, float) {
+        auto hit = photons.photon(photon);
+        if (_accepts(index, hit)) {
+          newPhotons += 1.f;
+          newFlux += hit.power;
+        }
+      });
+
+      _update(index, newPhotons, newFlux);
+    }
+  });
+
+  _batchCount++;
+}
+
+void ProgressiveEstimate::enableSplatting(const BoundingBox& sceneBounds) {
+  // Without points there is no radius to size the cells with, and no point a photon could be splatted to
+  if (_points.empty()) {
+    return;
+  }
+
+  std::vector<glm::vec3> positions(_points.size());
+  float radiusSquared = 0.f;
+  for (size_t index = 0; index < _points.size(); ++index) {
+    positions[index] = _points[index].position;
+    radiusSquared = std::max(radiusSquared, _statistics[index].radiusSquared);
+  }
+
+  // Radii only shrink, so cells sized for the current ones stay valid for every later batch
+  _grid = std::make_unique<VisiblePointGrid>(positions, std::sqrt(radiusSquared), sceneBounds);
+  _splatPhotons = std::make_unique<std::atomic<uint32_t>[]>(_points.size());
+  _splatFlux = std::make_unique<std::atomic<float>[]>(3 * _points.size());
+  for (size_t index = 0; index < _points.size(); ++index) {
+    _splatPhotons[index].store(0, std::memory_order_relaxed);
+    for (size_t channel = 0; channel < 3; ++channel) {
+      _splatFlux[3 * index + channel].store(0.f, std::memory_order_relaxed);
+    }
+  }
+}
+
+/// Atomic addition for floats, written as a compare and swap loop since fetch_add on floats is not available on every
+/// supported standard library
+static void atomicAdd(std::atomic<float>& target, float value) {
+  auto current = target.load(std::memory_order_relaxed);
+  while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {
+  }
+}
+
+void ProgressiveEstimate::splat(const PhotonHit& photon) {
+  if (!_grid) {
+    return;
+  }
+
+  _grid->forEachCandidate(photon.position, [&](uint32_t index) {
+    auto offset = photon.position - _points[index].position;
+    auto distanceSquared = glm::dot(offset, offset);
+
+    if (distanceSquared > _statistics[index].radiusSquared || !_accepts(index, photon)) {
+      return;
+    }
+
+    _splatPhotons[index].fetch_add(1, std::memory_order_relaxed);
+    atomicAdd(_splatFlux[3 * index], photon.power.x);
+    atomicAdd(_splatFlux[3 * index + 1], photon.power.y);
+    atomicAdd(_splatFlux[3 * index + 2], photon.power.z);
+  });
+}
+
+void ProgressiveEstimate::addSplattedPhotons() {
+  parallelFor((_points.size() + progressiveChunkSize - 1) / progressiveChunkSize, [&](size_t chunk) {
+    auto last = std::min(_points.size(), (chunk + 1) * progressiveChunkSize);
+
+    for (size_t index = chunk * progressiveChunkSize; index < last; ++index) {
+      auto newPhotons = (float)_splatPhotons[index].exchange(0, std::memory_order_relaxed);
+      glm::vec3 newFlux{
+        _splatFlux[3 * index].exchange(0.f, std::memory_order_relaxed),
+        _splatFlux[3 * index + 1].exchange(0.f, std::memory_order_relaxed),
+        _splatFlux[3 * index + 2].exchange(0.f, std::memory_order_relaxed)
+      };
+
+      _update(index, newPhotons, newFlux);
+    }
+  });
+
+  _batchCount++;
+}
+
+bool ProgressiveEstimate::_accepts(size_t index, const PhotonHit& photon) const {
+  if (glm::dot(photon.normal, _points[index].normal) < progressiveNormalCosine) {
+    return false;
+  }
+
+  return !std::isnan(photon.power.x) && !std::isnan(photon.power.y) && !std::isnan(photon.power.z);
+}
+
+void ProgressiveEstimate::_update(size_t index, float newPhotons, glm::vec3 newFlux) {
+  if (newPhotons == 0.f) {
+    return;
+  }
+
+  auto& statistics = _statistics[index];
+
+  // Only a fraction alpha of the new photons is kept, and the radius shrinks so the density stays the same. The flux
+  // is scaled by the area lost, which removes the photons that would now be outside the disc
+  auto keptPhotons = statistics.photonCount + progressiveAlpha * newPhotons;
+  auto shrink = keptPhotons / (statistics.photonCount + newPhotons);
+
+  statistics.radiusSquared *= shrink;
+  statistics.photonCount = keptPhotons;
+  statistics.flux = (statistics.flux + newFlux) * shrink;
+}
+
+void ProgressiveEstimate::addRadiance(std::vector<glm::vec3>& pixels) const {
+  if (_batchCount == 0) {
+    return;
+  }
+
+  for (size_t index = 0; index < _points.size(); ++index) {
+    const auto& statistics = _statistics[index];
+    auto radiance = statistics.flux / (PI * statistics.radiusSquared * (float)_batchCount);
+
+    pixels[_points[index].pixel] += _points[index].weight * radiance;
+  }
+}
+
+unsigned int ProgressiveEstimate::batchCount() const {
+  return _batchCount;
+}
+
+size_t ProgressiveEstimate::size() const {
+  return _points.size();
+}
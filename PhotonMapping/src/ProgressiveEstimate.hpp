@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "BoundingBox.hpp"
+#include "PhotonHit.hpp"
+#include "PhotonKdTree.hpp"
+#include "VisiblePointGrid.hpp"
+
+/// Shading point seen from the camera, directly or through reflections and refractions, whose indirect illumination
+/// is estimated progressively
+struct VisiblePoint {
+  glm::vec3 position;
+  glm::vec3 normal;
+  /// Fraction of the light leaving the point that reaches the pixel, including the diffuse color of the surface
+  glm::vec3 weight;
+  /// Index of the pixel in the image, y * width + x
+  uint32_t pixel;
+};
+
+/// Stochastic progressive photon mapping estimate (Hachisuka and Jensen 2009) of the indirect illumination of a fixed
+/// set of visible points. Photons are added in batches that can be discarded right after, every point keeps the
+/// photons and flux found so far while its radius shrinks, so memory does not grow with the number of photons and
+/// the estimate converges as more batches are added
+class ProgressiveEstimate {
+public:
+  /// - Parameters:
+  ///   - points: points whose illumination is estimated
+  ///   - initialRadius: search radius of every point before the first batch
+  ProgressiveEstimate(std::vector<VisiblePoint> points, float initialRadius);
+
+  /// Gathers the photons of a batch at every point and shrinks the radius of the points that found any. The power of
+  /// the photons of each batch must add up to the power of the lights
+  /// - Parameter photons: photons of the batch
+  void addPhotons(const PhotonKdTree& photons);
+
+  /// Builds the grid used by splat. Until it is called only addPhotons can be used. Does nothing without visible
+  /// points, splat then ignores every photon
+  /// - Parameter sceneBounds: box containing every visible point
+  void enableSplatting(const BoundingBox& sceneBounds);
+
+  /// Adds the photon to every point whose disc contains it. Safe to call from many threads at once, the photons and
+  /// flux of each point are accumulated with atomic operations until addSplattedPhotons
+  /// - Parameter photon: photon hit to add
+  void splat(const PhotonHit& photon);
+
+  /// Ends a batch of splatted photons, updating the points as addPhotons does. Must not run concurrently with splat
+  void addSplattedPhotons();
+
+  /// Adds the radiance estimated at each point, scaled by its weight, to the color of its pixel
+  /// - Parameter pixels: colors of the image, indexed by VisiblePoint::pixel
+  void addRadiance(std::vector<glm::vec3>& pixels) const;
+
+  /// Number of batches added
+  unsigned int batchCount() const;
+
+  /// Number of visible points
+  size_t size() const;
+
+private:
+  /// Accumulated state of a visible point
+  struct Statistics {
+    float radiusSquared;
+    /// Photons found, reduced by alpha after each batch as the radius shrinks
+    float photonCount;
+    /// Power of the photons inside the current radius
+    glm::vec3 flux;
+  };
+
+  std::vector<VisiblePoint> _points;
+  std::vector<Statistics> _statistics;
+  unsigned int _batchCount = 0;
+
+  // Splatting state, empty until enableSplatting
+  std::unique_ptr<VisiblePointGrid> _grid;
+  std::unique_ptr<std::atomic<uint32_t>[]> _splatPhotons;
+  /// Three channels per point
+  std::unique_ptr<std::atomic<float>[]> _splatFlux;
+
+  /// Whether the photon counts for the point
+  bool _accepts(size_t index, const PhotonHit& photon) const;
+
+  /// Adds the photons found by a batch to the point, shrinking its radius
+  void _update(size_t index, float newPhotons, glm::vec3 newFlux);
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+
+/// How the photons around a shading point are turned into radiance
+enum class RadianceEstimate {
+  /// Every photon inside the sampling distance, weighted by a gaussian filter
+  Range,
+  /// The PHOTONS_PER_SAMPLE nearest photons divided by the area of the disc containing them
+  Nearest
+};
+
+/// How the progressive mode finds the visible points reached by each photon
+enum class ProgressiveGather {
+  /// The photons of each batch are stored in a tree searched from every visible point
+  Tree,
+  /// Each photon is added to the visible points around it through a hash grid as soon as it is traced
+  Grid
+};
+
+/// Largest PHOTONS_PER_SAMPLE accepted by the nearest estimate, the photons found are kept on the stack
+constexpr unsigned int maxPhotonsPerSample = 1024;
+
+/// Parameters of a render, read once from the constants of the scene file. Values missing in the file keep the
+/// defaults below. The settings are owned by the Scene and never change after it is built, so they are read through
+/// plain member access instead of looking them up by name
+struct RenderSettings {
+  /// Size of the rendered image in pixels
+  unsigned int width = 512;
+  unsigned int height = 512;
+
+  /// Maximum number of reflections and refractions followed from the camera
+  unsigned int maxDepth = 5;
+  /// Maximum number of bounces followed for each photon
+  unsigned int maxPhotonDepth = 10;
+  /// Photons used by the nearest radiance estimate
+  unsigned int photonsPerSample = 250;
+  /// Photons shot for each map, split evenly between the lights
+  unsigned int photonLimit = 10000;
+
+  /// Offset used to move ray origins away from the surface they start on
+  float epsilon = 0.00001f;
+  /// Radius of the photon search around each shading point, the nearest estimate never looks farther either
+  float maxPhotonSamplingDistance = 0.6f;
+  RadianceEstimate radianceEstimate = RadianceEstimate::Range;
+  /// Width of the gaussian filter applied to the photons found
+  float delta = 0.2f;
+  /// Power shared by all photons of a light
+  float totalLight = 150.f;
+  float gammaCorrection = 2.2f;
+
+  bool shouldPrintCausticsHitPhotonMap = false;
+  bool shouldPrintDepthPhotonMap = false;
+  bool shouldPrintHitPhotonMap = false;
+  /// Loads the photon maps saved by a previous run instead of shooting photons
+  bool loadTree = false;
+  /// Stores the photon maps compressed, see CompactPhoton
+  bool compactPhotons = false;
+  /// Rays shot over the hemisphere of each shading point to gather the indirect light from the global map at their
+  /// hits, 0 reads the global map directly at the shading point
+  unsigned int finalGatherRays = 0;
+  /// Batches of PHOTON_LIMIT global photons added to the progressive estimate, 0 builds a global photon map instead.
+  /// Each batch is discarded once added, so memory does not grow with the number of batches
+  unsigned int progressivePasses = 0;
+  ProgressiveGather progressiveGather = ProgressiveGather::Tree;
+  /// Estimates the irradiance of the global map at its photons before rendering, see Renderer::precomputeIrradiance
+  bool precomputeIrradiance = false;
+
+  /// Renders each tile breadth first, see Renderer::renderTileWavefront
+  bool wavefront = false;
+
+  /// Renders with the same seed draw the same random numbers
+  uint32_t seed = 0;
+
+  /// Throws std::invalid_argument if a value can not be rendered
+  void validate() const {
+    if (width == 0 || height == 0) {
+      throw std::invalid_argument("RenderSettings: WIDTH and HEIGHT must be greater than 0");
+    }
+    if (photonLimit == 0) {
+      throw std::invalid_argument("RenderSettings: PHOTON_LIMIT must be greater than 0");
+    }
+    if (radianceEstimate == RadianceEstimate::Nearest && (photonsPerSample == 0 || photonsPerSample > maxPhotonsPerSample)) {
+      throw std::invalid_argument("RenderSettings: PHOTONS_PER_SAMPLE must be between 1 and 1024");
+    }
+    if (!(epsilon > 0.f)) {
+      throw std::invalid_argument("RenderSettings: EPSILON must be greater than 0");
+    }
+    if (!(maxPhotonSamplingDistance > 0.f)) {
+      throw std::invalid_argument("RenderSettings: MAX_PHOTON_SAMPLING_DISTANCE must be greater than 0");
+    }
+    if (!(delta > 0.f)) {
+      throw std::invalid_argument("RenderSettings: DELTA must be greater than 0");
+    }
+    if (!(totalLight >= 0.f)) {
+      throw std::invalid_argument("RenderSettings: TOTAL_LIGHT can not be negative");
+    }
+    if (!(gammaCorrection > 0.f)) {
+      throw std::invalid_argument("RenderSettings: GAMMA_CORRECTION must be greater than 0");
+    }
+  }
+};
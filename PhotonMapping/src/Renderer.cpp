@@ -1,20 +1,23 @@
 #include "Renderer.hpp"
 
+#include <cmath>
 #include <iostream>
 #include <glm/gtx/norm.hpp>
 
 #include "EmbreeWrapper.hpp"
 #include "Constants.hpp"
+#include "Sampler.hpp"
+#include "Utils.hpp"
 
 void Renderer::setScene(std::shared_ptr<Scene> scene) {
   _scene = scene;
 }
 
-void Renderer::setTree(std::shared_ptr<Kdtree::KdTree> tree) {
+void Renderer::setTree(std::shared_ptr<PhotonKdTree> tree) {
   _tree = tree;
 }
 
-void Renderer::setCausticsTree(std::shared_ptr<Kdtree::KdTree> tree) {
+void Renderer::setCausticsTree(std::shared_ptr<PhotonKdTree> tree) {
   _caustics_tree = tree;
 }
 
@@ -24,7 +27,7 @@ glm::vec3 Renderer::renderPixel(
   uint_fast32_t width,
   uint_fast32_t height,
   Color3f* pmColor
-) {
+) const {
   // TODO: Multiple samples per pixel
   return _renderPixelSample(x, y, width, height, pmColor);
 }
@@ -35,46 +38,320 @@ glm::vec3 Renderer::_renderPixelSample(
   uint_fast32_t width,
   uint_fast32_t height,
   Color3f* pmColor
-) {
+) const {
   auto camera = _scene->getCamera();
   auto direction = camera->pixelRayDirection(x, y, width, height);
 
-  return _calculateColor(camera->origin, direction, INT_CONSTANTS[MAX_DEPTH], pmColor, false);
+  return _calculateColor(camera->origin, direction, _scene->getSettings().maxDepth, pmColor, false);
 }
 
-float discDistanceFactor(glm::vec3 photon_position, Intersection &intersection, float delta, bool gaussian_mode = true) {
-  auto diff = glm::normalize(photon_position - intersection.position);
-  bool in_disc_plane = glm::abs(glm::dot(diff, intersection.normal)) <= 100.f * FLOAT_CONSTANTS[EPSILON];
-  bool points_close = glm::distance2(photon_position, intersection.position) <= 100.f * FLOAT_CONSTANTS[EPSILON];
+void Renderer::renderTile(
+  const Tile& tile,
+  uint_fast32_t width,
+  uint_fast32_t height,
+  const std::function<void(uint_fast32_t, uint_fast32_t, Color3f, const Color3f*)>& writePixel
+) const {
+  const auto& settings = _scene->getSettings();
+  auto camera = _scene->getCamera();
+  auto tileWidth = tile.x1 - tile.x0;
+  auto pixelCount = (size_t)tileWidth * (tile.y1 - tile.y0);
+
+  thread_local std::vector<glm::vec3> origins;
+  thread_local std::vector<glm::vec3> directions;
+  thread_local std::vector<std::optional<Intersection>> intersections;
+  origins.assign(pixelCount, camera->origin);
+  directions.resize(pixelCount);
+  intersections.resize(pixelCount);
+
+  for (size_t pixel = 0; pixel < pixelCount; ++pixel) {
+    directions[pixel] = camera->pixelRayDirection(
+      tile.x0 + pixel % tileWidth, tile.y0 + pixel / tileWidth, width, height
+    );
+  }
+
+  intersectRays(origins.data(), directions.data(), pixelCount, intersections.data(), _scene);
+
+  for (size_t pixel = 0; pixel < pixelCount; ++pixel) {
+    uint_fast32_t x = tile.x0 + pixel % tileWidth;
+    uint_fast32_t y = tile.y0 + pixel / tileWidth;
+
+    // Seeding per pixel keeps the image identical whatever thread renders the tile
+    seedThreadSampler(settings.seed, SampleStream::Pixels, (uint64_t)y * width + x);
+
+    Color3f pmColor[3] = { glm::vec3(0.f), glm::vec3(0.f), glm::vec3(0.f) };
+    auto color = _shade(intersections[pixel], settings.maxDepth, pmColor, false);
+
+    writePixel(x, y, color, pmColor);
+  }
+}
+
+/// Photons precomputed into the irradiance map, one every irradianceSampleStride photons of the global map
+constexpr uint32_t irradianceSampleStride = 4;
+/// Nearest irradiance samples considered by a lookup, the closest one facing like the surface is used
+constexpr size_t irradianceCandidates = 8;
+/// Minimum cosine between the normals of the surface and of an irradiance sample for the sample to be used
+constexpr float irradianceNormalCosine = 0.9f;
+
+std::vector<VisiblePoint> Renderer::collectVisiblePoints(uint_fast32_t width, uint_fast32_t height) const {
+  const auto& settings = _scene->getSettings();
+  auto camera = _scene->getCamera();
+  std::vector<std::vector<VisiblePoint>> rows(height);
+
+  parallelFor(height, [&](size_t y) {
+    for (uint_fast32_t x = 0; x < width; ++x) {
+      auto direction = camera->pixelRayDirection(x, (uint_fast32_t)y, width, height);
+      _collectVisiblePoints(
+        camera->origin, direction, settings.maxDepth, glm::vec3{ 1.f }, false, (uint32_t)(y * width + x), rows[y]
+      );
+    }
+  });
+
+  std::vector<VisiblePoint> points;
+  for (auto& row : rows) {
+    points.insert(points.end(), row.begin(), row.end());
+  }
+
+  return points;
+}
+
+void Renderer::_collectVisiblePoints(
+  glm::vec3 origin, glm::vec3 direction, unsigned int depth, glm::vec3 weight, bool in, uint32_t pixel,
+  std::vector<VisiblePoint>& points
+) const {
+  auto result = _castRay(origin, direction);
+  if (!result.has_value() || result->material->emmisive) {
+    return;
+  }
+  auto& intersection = result.value();
+
+  // Follows the same rays as _shade, keeping how much of the light of each diffuse point reaches the pixel
+  if (intersection.material->diffuse > 0.f) {
+    points.push_back(VisiblePoint{
+      intersection.position, intersection.normal, weight * intersection.material->diffuseColor(), pixel
+    });
+  }
+
+  if (depth == 0) {
+    return;
+  }
+
+  if (intersection.material->reflection > 0.f && !in) {
+    auto reflectionDirection = glm::normalize(glm::reflect(intersection.direction, intersection.normal));
+    _collectVisiblePoints(
+      intersection.position, reflectionDirection, depth - 1, weight * intersection.material->reflection, in, pixel, points
+    );
+  }
+
+  if (intersection.material->transparency > 0.f) {
+    bool newIn = in;
+    auto refractionDirection = _refractionDirection(intersection, in, newIn);
+    auto colorFactor = in ? glm::vec3{ 1.f } : intersection.material->transparencyColor();
+
+    _collectVisiblePoints(
+      intersection.position + _scene->getSettings().epsilon * refractionDirection, refractionDirection, depth - 1,
+      weight * colorFactor, newIn, pixel, points
+    );
+  }
+}
+
+void Renderer::renderTileWavefront(
+  const Tile& tile,
+  uint_fast32_t width,
+  uint_fast32_t height,
+  const std::function<void(uint_fast32_t, uint_fast32_t, Color3f, const Color3f*)>& writePixel
+) const {
+  const auto& settings = _scene->getSettings();
+  auto camera = _scene->getCamera();
+  auto tileWidth = tile.x1 - tile.x0;
+  auto pixelCount = (size_t)tileWidth * (tile.y1 - tile.y0);
+
+  /// Totals of each pixel of the tile, the photon map colors follow the definitions of _shade
+  struct PixelTotals {
+    Color3f color;
+    Color3f indirect;
+    Color3f caustics;
+    /// Photon map light of the camera hit, subtracted from the color to get the ray traced image
+    Color3f primaryPhotonMaps;
+    bool primaryShaded;
+  };
+
+  thread_local std::vector<WavefrontRay> rays;
+  thread_local std::vector<WavefrontRay> nextRays;
+  thread_local std::vector<glm::vec3> origins;
+  thread_local std::vector<glm::vec3> directions;
+  thread_local std::vector<std::optional<Intersection>> hits;
+  thread_local std::vector<uint32_t> shadedHits;
+  thread_local std::vector<uint32_t> diffuseHits;
+  thread_local std::vector<const Intersection*> diffuseIntersections;
+  thread_local std::vector<Color3f> directLight;
+  thread_local ShadowRayBatch shadowRays;
+  thread_local std::vector<uint32_t> reflectiveHits;
+  thread_local std::vector<uint32_t> transparentHits;
+  thread_local std::vector<PixelTotals> pixels;
+
+  pixels.assign(pixelCount, PixelTotals{ Color3f{ 0.f }, Color3f{ 0.f }, Color3f{ 0.f }, Color3f{ 0.f }, false });
+  rays.clear();
+  for (size_t pixel = 0; pixel < pixelCount; ++pixel) {
+    auto direction = camera->pixelRayDirection(tile.x0 + pixel % tileWidth, tile.y0 + pixel / tileWidth, width, height);
+    rays.push_back(WavefrontRay{ camera->origin, direction, glm::vec3{ 1.f }, (uint32_t)pixel, settings.maxDepth, false });
+  }
+
+  // The rays of a tile are always processed in the same order, so seeding once per tile keeps the image identical
+  // whatever thread renders it
+  seedThreadSampler(settings.seed, SampleStream::Pixels, (uint64_t)tile.y0 * width + tile.x0);
+
+  for (bool primary = true; !rays.empty(); primary = false) {
+    origins.resize(rays.size());
+    directions.resize(rays.size());
+    hits.resize(rays.size());
+    for (size_t ray = 0; ray < rays.size(); ++ray) {
+      origins[ray] = rays[ray].origin;
+      directions[ray] = rays[ray].direction;
+    }
+
+    intersectRays(origins.data(), directions.data(), rays.size(), hits.data(), _scene, primary);
+
+    // Hits are sorted into one queue per kind of work, so each kernel below runs the same code over all its hits.
+    // A hit whose material mixes several kinds is in several queues
+    shadedHits.clear();
+    diffuseHits.clear();
+    reflectiveHits.clear();
+    transparentHits.clear();
+    for (uint32_t ray = 0; ray < rays.size(); ++ray) {
+      auto& totals = pixels[rays[ray].pixel];
+
+      if (!hits[ray].has_value()) {
+        totals.color += rays[ray].weight * _scene->ambient;
+        continue;
+      }
+
+      const auto& material = *hits[ray]->material;
+      if (material.emmisive) {
+        totals.color += rays[ray].weight;
+        continue;
+      }
+
+      shadedHits.push_back(ray);
+      if (material.diffuse > 0.f) {
+        diffuseHits.push_back(ray);
+      }
+      if (material.reflection > 0.f && !rays[ray].in && rays[ray].depth > 0) {
+        reflectiveHits.push_back(ray);
+      }
+      if (material.transparency > 0.f && rays[ray].depth > 0) {
+        transparentHits.push_back(ray);
+      }
+    }
+
+    // Direct light like _renderDiffuse, the shadow rays of every diffuse hit are traced with one stream per light
+    diffuseIntersections.clear();
+    for (auto ray : diffuseHits) {
+      diffuseIntersections.push_back(&hits[ray].value());
+    }
+    directLight.assign(diffuseHits.size(), Color3f{ 0.f });
+    for (const auto& light : _scene->getLights()) {
+      light->intensitiesFrom(
+        diffuseIntersections.data(), diffuseIntersections.size(), _scene->scene, settings, shadowRays, directLight.data()
+      );
+    }
+    for (size_t hit = 0; hit < diffuseHits.size(); ++hit) {
+      auto ray = diffuseHits[hit];
+      pixels[rays[ray].pixel].color += rays[ray].weight * directLight[hit] * hits[ray]->material->diffuse;
+    }
+
+    // Photon map lookups, every shaded hit reads both maps like _shade does
+    for (auto ray : shadedHits) {
+      auto& intersection = hits[ray].value();
+      auto& totals = pixels[rays[ray].pixel];
+      auto indirect = _indirectIllumination(intersection);
+      auto caustics = _causticIllumination(intersection);
+
+      totals.color += rays[ray].weight * (indirect + caustics);
+      totals.indirect += indirect;
+      totals.caustics += caustics;
+      if (primary) {
+        totals.primaryPhotonMaps = indirect + caustics;
+        totals.primaryShaded = true;
+      }
+    }
+
+    // Secondary rays are queued for the next pass instead of being traced right away
+    nextRays.clear();
+    for (auto ray : reflectiveHits) {
+      const auto& parent = rays[ray];
+      auto& intersection = hits[ray].value();
+      auto reflectionDirection = glm::normalize(glm::reflect(intersection.direction, intersection.normal));
+
+      nextRays.push_back(WavefrontRay{
+        intersection.position, reflectionDirection, parent.weight * intersection.material->reflection, parent.pixel,
+        parent.depth - 1, parent.in
+      });
+    }
+
+    for (auto ray : transparentHits) {
+      const auto& parent = rays[ray];
+      auto& intersection = hits[ray].value();
+      bool newIn = parent.in;
+      auto refractionDirection = _refractionDirection(intersection, parent.in, newIn);
+      auto colorFactor = parent.in ? glm::vec3{ 1.f } : intersection.material->transparencyColor();
+
+      nextRays.push_back(WavefrontRay{
+        intersection.position + settings.epsilon * refractionDirection, refractionDirection, parent.weight * colorFactor,
+        parent.pixel, parent.depth - 1, newIn
+      });
+    }
+
+    std::swap(rays, nextRays);
+  }
+
+  for (size_t pixel = 0; pixel < pixelCount; ++pixel) {
+    const auto& totals = pixels[pixel];
+    Color3f pmColor[3] = {
+      totals.indirect,
+      totals.caustics,
+      totals.primaryShaded ? totals.color - totals.primaryPhotonMaps : Color3f{ 0.f }
+    };
+
+    writePixel(tile.x0 + pixel % tileWidth, tile.y0 + pixel / tileWidth, totals.color, pmColor);
+  }
+}
+
+float discDistanceFactor(glm::vec3 photon_position, glm::vec3 position, glm::vec3 normal, float delta, float epsilon, bool gaussian_mode = true) {
+  auto diff = glm::normalize(photon_position - position);
+  bool in_disc_plane = glm::abs(glm::dot(diff, normal)) <= 100.f * epsilon;
+  bool points_close = glm::distance2(photon_position, position) <= 100.f * epsilon;
 
   if (points_close || in_disc_plane) {
     if (gaussian_mode) {
       auto exp_factor = (2.f * delta * delta);
       auto filter_factor = 1.f / (exp_factor * PI);
 
-      auto x = intersection.position.x - photon_position.x;
-      auto y = intersection.position.y - photon_position.y;
-      auto z = intersection.position.z - photon_position.z;
+      auto x = position.x - photon_position.x;
+      auto y = position.y - photon_position.y;
+      auto z = position.z - photon_position.z;
       auto exp = (x * x + y * y + z * z) / exp_factor;
       return filter_factor * glm::exp(-exp);
     } else {
-      return 1 + glm::distance(photon_position, intersection.position);
+      return 1 + glm::distance(photon_position, position);
     }
   } else {
     return 0.f;
   }
 }
 
-Color3f Renderer::_calculateColor(glm::vec3 origin, glm::vec3 direction, unsigned int depth, Color3f* pmColor, bool in) {
-  auto result = _castRay(origin, direction);
+Color3f Renderer::_calculateColor(glm::vec3 origin, glm::vec3 direction, unsigned int depth, Color3f* pmColor, bool in) const {
+  return _shade(_castRay(origin, direction), depth, pmColor, in);
+}
 
+Color3f Renderer::_shade(const std::optional<Intersection>& result, unsigned int depth, Color3f* pmColor, bool in) const {
   if (!result.has_value()) {
     return _scene->ambient;
   }
 
+  const auto& settings = _scene->getSettings();
   auto intersection = result.value();
 
-  if (intersection.material.emmisive) {
+  if (intersection.material->emmisive) {
     return Color3f { 1.f };
   }
 
@@ -82,33 +359,22 @@ Color3f Renderer::_calculateColor(glm::vec3 origin, glm::vec3 direction, unsigne
   Color3f specularColor { 0.f };
   Color3f transparentColor { 0.f };
 
-  if (intersection.material.diffuse > 0.f) {
+  if (intersection.material->diffuse > 0.f) {
     diffuseColor = _renderDiffuse(intersection);
   }
 
-  if (intersection.material.reflection > 0.f && !in) {
+  if (intersection.material->reflection > 0.f && !in) {
     specularColor = _renderSpecular(intersection, depth, pmColor, in);
   }
 
-  if (intersection.material.transparency > 0.f) {
+  if (intersection.material->transparency > 0.f) {
     transparentColor = _renderTransparent(intersection, depth, pmColor, in);
   }
 
-  std::vector<float> point{ intersection.position.x, intersection.position.y, intersection.position.z };
-  Kdtree::KdNodeVector* caustic_neighbors = new std::vector<Kdtree::KdNode>();
-  _caustics_tree->range_nearest_neighbors(point, FLOAT_CONSTANTS[MAX_PHOTON_SAMPLING_DISTANCE] / 2.f, caustic_neighbors);
-
-  glm::vec3 caustics{ 0.f };
-  for (auto neighbor : *caustic_neighbors) {
-    auto rho = intersection.material.diffuseColor();
-    auto weight = discDistanceFactor(neighbor.data.position, intersection, FLOAT_CONSTANTS[DELTA] / 3.f);
-    caustics += neighbor.data.power * weight * rho;
-  }
-
-  delete caustic_neighbors;
+  auto caustics = _causticIllumination(intersection);
 
   auto rayTracing = diffuseColor + specularColor + transparentColor;
-  auto indirectIllumination = _computeRadianceWithPhotonMap(intersection);
+  auto indirectIllumination = _indirectIllumination(intersection);
 
   if (indirectIllumination.x < 0.f || indirectIllumination.y < 0.f || indirectIllumination.z < 0.f) {
     std::cout << indirectIllumination.x << ", " << indirectIllumination.y << ", " << indirectIllumination.z << std::endl;
@@ -119,49 +385,179 @@ Color3f Renderer::_calculateColor(glm::vec3 origin, glm::vec3 direction, unsigne
   
   pmColor[0] += indirectIllumination;
   pmColor[1] += caustics;
-  if (depth == INT_CONSTANTS[MAX_DEPTH]) {
+  if (depth == settings.maxDepth) {
     pmColor[2] += rayTracing;
   }
   return rayTracing + indirectIllumination + caustics;
 }
 
-Color3f Renderer::_computeRadianceWithPhotonMap(Intersection &intersection) {
-  glm::vec3 indirectIllumination { 0.f };
+Color3f Renderer::_indirectIllumination(Intersection &intersection) const {
+  const auto& settings = _scene->getSettings();
+
+  // Without a global map the indirect illumination is estimated progressively from the visible points
+  if (!_tree) {
+    return Color3f { 0.f };
+  }
+
+  if (settings.finalGatherRays > 0 && intersection.material->diffuse > 0.f) {
+    return _finalGather(intersection);
+  }
+
+  return _computeRadianceWithPhotonMap(intersection);
+}
+
+Color3f Renderer::_causticIllumination(Intersection &intersection) const {
+  const auto& settings = _scene->getSettings();
+
+  return _estimateRadiance(
+    *_caustics_tree, intersection, settings.maxPhotonSamplingDistance / 2.f, settings.delta / 3.f
+  );
+}
+
+void Renderer::precomputeIrradiance() {
+  const auto& settings = _scene->getSettings();
+  auto sampleCount = (_tree->size() + irradianceSampleStride - 1) / irradianceSampleStride;
+  std::vector<PhotonHit> samples(sampleCount);
+
+  parallelFor(sampleCount, [&](size_t sample) {
+    auto photon = _tree->photon((uint32_t)(sample * irradianceSampleStride));
+    photon.power = _estimateIrradiance(
+      *_tree, photon.position, photon.normal, settings.maxPhotonSamplingDistance, settings.delta
+    );
+    samples[sample] = photon;
+  });
+
+  _irradiance_tree = std::make_shared<PhotonKdTree>(samples);
+  std::cout << "Precomputed irradiance at " << sampleCount << " photons" << std::endl;
+}
+
+Color3f Renderer::_computeRadianceWithPhotonMap(Intersection &intersection) const {
+  const auto& settings = _scene->getSettings();
 
-  std::vector<float> point{ intersection.position.x, intersection.position.y, intersection.position.z };
-  Kdtree::KdNodeVector* neighbors = new std::vector<Kdtree::KdNode>();
-  _tree->range_nearest_neighbors(point, FLOAT_CONSTANTS[MAX_PHOTON_SAMPLING_DISTANCE], neighbors);
+  if (_irradiance_tree) {
+    NearestPhotons<irradianceCandidates> nearest;
+    _irradiance_tree->nearestPhotons(
+      intersection.position, irradianceCandidates, settings.maxPhotonSamplingDistance, nearest
+    );
 
-  for (auto neighbor : *neighbors) {
-      auto rho = intersection.material.diffuseColor();
-      auto distanceFactor = discDistanceFactor(neighbor.data.position, intersection, FLOAT_CONSTANTS[DELTA]);
-      auto power = neighbor.data.power;
-      if(isnan(power.x) || isnan(power.y) || isnan(power.z)) {
+    // Samples on surfaces facing elsewhere, like the other side of a corner, would leak their light
+    const PhotonDistance* closest = nullptr;
+    for (size_t i = 0; i < nearest.size; ++i) {
+      const auto& candidate = nearest.photons[i];
+      if (closest != nullptr && candidate.distanceSquared >= closest->distanceSquared) {
         continue;
       }
-      indirectIllumination += distanceFactor * rho * power;
+      if (glm::dot(_irradiance_tree->photon(candidate.index).normal, intersection.normal) >= irradianceNormalCosine) {
+        closest = &candidate;
+      }
+    }
+
+    if (closest != nullptr) {
+      return intersection.material->diffuseColor() * _irradiance_tree->power(closest->index);
+    }
   }
- 
-  delete neighbors;
-  
-  return indirectIllumination;
+
+  return _estimateRadiance(*_tree, intersection, settings.maxPhotonSamplingDistance, settings.delta);
+}
+
+Color3f Renderer::_finalGather(Intersection &intersection) const {
+  auto rayCount = _scene->getSettings().finalGatherRays;
+
+  thread_local std::vector<float> random;
+  thread_local std::vector<glm::vec3> origins;
+  thread_local std::vector<glm::vec3> directions;
+  thread_local std::vector<std::optional<Intersection>> hits;
+  random.resize(2 * (size_t)rayCount);
+  origins.assign(rayCount, intersection.position);
+  directions.resize(rayCount);
+  hits.resize(rayCount);
+
+  // Rays leave from the side of the surface the camera ray arrived from
+  auto normal = glm::dot(intersection.normal, intersection.direction) > 0.f ? -intersection.normal : intersection.normal;
+
+  threadSampler().fill01(random.data(), random.size());
+  for (size_t ray = 0; ray < rayCount; ++ray) {
+    directions[ray] = cosineSampleHemisphere(normal, random[2 * ray], random[2 * ray + 1]);
+  }
+
+  intersectRays(origins.data(), directions.data(), rayCount, hits.data(), _scene, false);
+
+  // With cosine distributed rays the cosine and pdf cancel out, leaving the average radiance arriving from the hits.
+  // Light sources are skipped because their light is already added by _renderDiffuse
+  glm::vec3 radiance { 0.f };
+  for (auto& hit : hits) {
+    if (!hit.has_value() || hit->material->emmisive) {
+      continue;
+    }
+    radiance += _computeRadianceWithPhotonMap(*hit);
+  }
+
+  return intersection.material->diffuseColor() * radiance / (float)rayCount;
+}
+
+Color3f Renderer::_estimateRadiance(
+  const PhotonKdTree& tree, Intersection &intersection, float maxRadius, float delta
+) const {
+  auto irradiance = _estimateIrradiance(tree, intersection.position, intersection.normal, maxRadius, delta);
+
+  return intersection.material->diffuseColor() * irradiance;
+}
+
+glm::vec3 Renderer::_estimateIrradiance(
+  const PhotonKdTree& tree, glm::vec3 position, glm::vec3 normal, float maxRadius, float delta
+) const {
+  const auto& settings = _scene->getSettings();
+  glm::vec3 irradiance { 0.f };
+
+  if (settings.radianceEstimate == RadianceEstimate::Nearest) {
+    NearestPhotons<maxPhotonsPerSample> nearest;
+    tree.nearestPhotons(position, settings.photonsPerSample, maxRadius, nearest);
+
+    if (nearest.size == 0) {
+      return irradiance;
+    }
+
+    for (size_t i = 0; i < nearest.size; ++i) {
+      auto power = tree.power(nearest.photons[i].index);
+      if (std::isnan(power.x) || std::isnan(power.y) || std::isnan(power.z)) {
+        continue;
+      }
+      irradiance += power;
+    }
+
+    // When less photons than requested are found the disc is the whole search area, so sparse regions are not
+    // brightened by dividing by the small area around a few close photons
+    auto radiusSquared = nearest.size < settings.photonsPerSample ? maxRadius * maxRadius : nearest.maxDistanceSquared();
+    return irradiance / (PI * std::max(radiusSquared, settings.epsilon));
+  }
+
+  // The estimate is accumulated while the tree is traversed, so no photon is copied and nothing is allocated
+  tree.gather(position, maxRadius, [&](uint32_t index, float) {
+    auto power = tree.power(index);
+    if (std::isnan(power.x) || std::isnan(power.y) || std::isnan(power.z)) {
+      return;
+    }
+    irradiance += discDistanceFactor(tree.position(index), position, normal, delta, settings.epsilon) * power;
+  });
+
+  return irradiance;
 }
 
-std::optional<Intersection> Renderer::_castRay(glm::vec3 origin, glm::vec3 direction) {
+std::optional<Intersection> Renderer::_castRay(glm::vec3 origin, glm::vec3 direction) const {
   return intersectRay(origin, direction, _scene);
 }
 
-Color3f Renderer::_renderDiffuse(Intersection &intersection) {
+Color3f Renderer::_renderDiffuse(Intersection &intersection) const {
   Color3f color{ 0.f };
   
   for (const auto light : _scene->getLights()) {
-    color += light->intensityFrom(intersection, _scene->scene);
+    color += light->intensityFrom(intersection, _scene->scene, _scene->getSettings());
   }
 
-  return color * intersection.material.diffuse;
+  return color * intersection.material->diffuse;
 }
 
-Color3f Renderer::_renderSpecular(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in) {
+Color3f Renderer::_renderSpecular(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in) const {
   if (depth == 0) {
     return Color3f {0.f};
   }
@@ -169,7 +565,7 @@ Color3f Renderer::_renderSpecular(Intersection &intersection, unsigned int depth
   auto origin = intersection.position;
   auto reflectionDirection = glm::normalize(glm::reflect(intersection.direction, intersection.normal));
 
-  auto color = _calculateColor(origin, reflectionDirection, depth - 1, pmColor, in) * intersection.material.reflection;
+  auto color = _calculateColor(origin, reflectionDirection, depth - 1, pmColor, in) * intersection.material->reflection;
 
   return color;
 }
@@ -177,11 +573,7 @@ Color3f Renderer::_renderSpecular(Intersection &intersection, unsigned int depth
 unsigned int invertedNormalCount = 0;
 unsigned int nonInvertedNormalCount = 0;
 
-Color3f Renderer::_renderTransparent(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in) {
-  if (depth == 0) {
-    return Color3f { 0.f };
-  }
-
+glm::vec3 Renderer::_refractionDirection(Intersection &intersection, bool in, bool& newIn) const {
   auto cosTita = glm::dot(-intersection.normal, intersection.direction);
   auto normal = intersection.normal;
   float nuIt;
@@ -191,31 +583,38 @@ Color3f Renderer::_renderTransparent(Intersection &intersection, unsigned int de
   }
 
   if (in) {
-    nuIt = intersection.material.refractionIndex / 1.0;
+    nuIt = intersection.material->refractionIndex / 1.0;
   } else {
-    nuIt = 1.0 / intersection.material.refractionIndex;
+    nuIt = 1.0 / intersection.material->refractionIndex;
   }
 
   float Ci = cosTita;
   float SiSqrd = 1 - pow(Ci, 2);
   float discriminant = 1 - pow(nuIt, 2) * SiSqrd;
-  glm::vec3 refractionDirection; 
-  bool newIn = in;
+  newIn = in;
   if (discriminant < 0) {
-    refractionDirection = glm::normalize(glm::reflect(intersection.direction, intersection.normal));
+    return glm::normalize(glm::reflect(intersection.direction, intersection.normal));
   }
-  else {
-    refractionDirection = nuIt * intersection.direction + (Ci * nuIt - sqrtf(discriminant)) * normal;
-    newIn = !in;
+
+  newIn = !in;
+  return nuIt * intersection.direction + (Ci * nuIt - sqrtf(discriminant)) * normal;
+}
+
+Color3f Renderer::_renderTransparent(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in) const {
+  if (depth == 0) {
+    return Color3f { 0.f };
   }
 
-  glm::vec3 refractionPosition = intersection.position + FLOAT_CONSTANTS[EPSILON] * refractionDirection;
+  bool newIn = in;
+  auto refractionDirection = _refractionDirection(intersection, in, newIn);
+
+  glm::vec3 refractionPosition = intersection.position + _scene->getSettings().epsilon * refractionDirection;
 
   Color3f color{ 0.f };
 
   Color3f color_factor = glm::vec3{1.f};
   if (!in) {
-    color_factor = intersection.material.transparencyColor();
+    color_factor = intersection.material->transparencyColor();
   }
 
   color += _calculateColor(
@@ -234,9 +633,9 @@ Color3f Renderer::_renderTransparent(Intersection &intersection, unsigned int de
 //
 //    auto refractionDirection = refractionPerpendicular + refractionParallel;
 //    color += _calculateColor(
-//      intersection.position + glm::vec3(FLOAT_CONSTANTS[EPSILON]) * intersection.direction,
+//      intersection.position + glm::vec3(_scene->getSettings().epsilon) * intersection.direction,
 //      refractionDirection, depth - 1
-//    ) * intersection.material.transparency;
+//    ) * intersection.material->transparency;
 //  }
 
   return color * color_factor;
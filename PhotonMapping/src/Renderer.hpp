@@ -1,36 +1,20 @@
 #pragma once
 
+#include <functional>
 #include <optional>
 
 #include <glm/glm.hpp>
 
 #include "Scene.hpp"
 #include "Material.hpp"
-#include "KDTree.hpp"
+#include "PhotonKdTree.hpp"
 #include "Intersection.hpp"
+#include "Parallel.hpp"
+#include "ProgressiveEstimate.hpp"
 
   // Created this to indicate with types when we intend to use the values as color or position
 using Color3f = glm::vec3;
 
-struct InSameSurfacePredicate : Kdtree::KdNodePredicate {
-  glm::vec3 position;
-  glm::vec3 normal;
-
-  InSameSurfacePredicate(glm::vec3 position, glm::vec3 normal) :
-    position(position),
-    normal(normal) {}
-
-  bool operator()(const Kdtree::KdNode& node) const {
-    if (node.data.normal != normal) {
-      return false;
-    }
-
-    auto directionToPhoton = node.data.position - position;
-
-    return glm::abs(glm::dot(directionToPhoton, normal)) < FLOAT_CONSTANTS[EPSILON];
-  }
-};
-
   /// The Renderer is responsible for creating the image and executing the photon mapping algorithm
 class Renderer {
 public:
@@ -40,30 +24,132 @@ public:
     ///   - y: vertical coordinate for the requested pixel
     ///   - width: horizontal size for the image
     ///   - height: vertical size for the image
-  Color3f renderPixel(uint_fast32_t x, uint_fast32_t y, uint_fast32_t width, uint_fast32_t height, Color3f* pmColor);
+    /// Rendering does not modify the renderer, so pixels can be rendered from several threads at once
+  Color3f renderPixel(uint_fast32_t x, uint_fast32_t y, uint_fast32_t width, uint_fast32_t height, Color3f* pmColor) const;
+
+    /// Renders every pixel of the tile. Camera rays of the tile are traced in packets, which is faster than calling
+    /// renderPixel for each pixel
+    /// - Parameters:
+    ///   - tile: region of the image to render
+    ///   - width: horizontal size for the image
+    ///   - height: vertical size for the image
+    ///   - writePixel: receives the coordinates, the color and the photon map colors of each pixel
+  void renderTile(
+    const Tile& tile, uint_fast32_t width, uint_fast32_t height,
+    const std::function<void(uint_fast32_t, uint_fast32_t, Color3f, const Color3f*)>& writePixel
+  ) const;
+
+    /// Traces the camera ray of every pixel through reflections and refractions like the renderer does, returning the
+    /// diffuse points found with the weight of their light in the pixel. Used by the progressive mode, which estimates
+    /// the indirect illumination of these points instead of reading a global map
+    /// - Parameters:
+    ///   - width: horizontal size for the image
+    ///   - height: vertical size for the image
+  std::vector<VisiblePoint> collectVisiblePoints(uint_fast32_t width, uint_fast32_t height) const;
+
+    /// Renders every pixel of the tile breadth first. All the rays of a bounce are intersected together, then their hits
+    /// go through one kernel per kind of work (direct light, photon maps, reflection, refraction) and the reflected and
+    /// refracted rays are queued for the next bounce. Same image as renderTile up to the random numbers drawn
+    /// - Parameters:
+    ///   - tile: region of the image to render
+    ///   - width: horizontal size for the image
+    ///   - height: vertical size for the image
+    ///   - writePixel: receives the coordinates, the color and the photon map colors of each pixel
+  void renderTileWavefront(
+    const Tile& tile, uint_fast32_t width, uint_fast32_t height,
+    const std::function<void(uint_fast32_t, uint_fast32_t, Color3f, const Color3f*)>& writePixel
+  ) const;
 
     /// Sets the scene used by the renderer
     /// - Parameter scene: shared scene pointer
   void setScene(std::shared_ptr<Scene> scene);
 
-  void setTree(std::shared_ptr<Kdtree::KdTree> tree);
-
-  void setCausticsTree(std::shared_ptr<Kdtree::KdTree> tree);
+    /// Sets the global photon map. Without one the indirect illumination is left out of the render, to be added by
+    /// the progressive estimate
+  void setTree(std::shared_ptr<PhotonKdTree> tree);
 
-private:
-  Color3f _renderPixelSample(uint_fast32_t x, uint_fast32_t y, uint_fast32_t width, uint_fast32_t height, Color3f* pmColor);
+  void setCausticsTree(std::shared_ptr<PhotonKdTree> tree);
 
-  Color3f _calculateColor(glm::vec3 origin, glm::vec3 direction, unsigned int depth, Color3f* pmColor, bool in);
+    /// Estimates the irradiance of the global map once at a subset of its photons and keeps them in a second tree.
+    /// Afterwards the indirect illumination of each shading point is read from the closest sample with a similar
+    /// normal instead of gathering every photon around it. Must be called after setTree
+  void precomputeIrradiance();
 
-  std::optional<Intersection> _castRay(glm::vec3 origin, glm::vec3 direction);
-
-  Color3f _renderDiffuse(Intersection &intersection);
-  Color3f _renderSpecular(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in);
-  Color3f _renderTransparent(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in);
+private:
+  /// Ray waiting in the queue of a wavefront pass
+  struct WavefrontRay {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    /// Fraction of the light carried by the ray that reaches the pixel
+    glm::vec3 weight;
+    /// Index of the pixel inside the tile
+    uint32_t pixel;
+    /// Bounces left
+    unsigned int depth;
+    bool in;
+  };
+
+  Color3f _renderPixelSample(uint_fast32_t x, uint_fast32_t y, uint_fast32_t width, uint_fast32_t height, Color3f* pmColor) const;
+
+  Color3f _calculateColor(glm::vec3 origin, glm::vec3 direction, unsigned int depth, Color3f* pmColor, bool in) const;
+
+  Color3f _shade(const std::optional<Intersection>& result, unsigned int depth, Color3f* pmColor, bool in) const;
+
+  std::optional<Intersection> _castRay(glm::vec3 origin, glm::vec3 direction) const;
+
+  Color3f _renderDiffuse(Intersection &intersection) const;
+  Color3f _renderSpecular(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in) const;
+  Color3f _renderTransparent(Intersection &intersection, unsigned int depth, Color3f* pmColor, bool in) const;
+
+  /// Direction of the ray refracted at the intersection, or reflected if there is total internal reflection
+  /// - Parameters:
+  ///   - intersection: point where the ray enters or leaves the object
+  ///   - in: whether the ray travels inside the object
+  ///   - newIn: receives whether the new ray travels inside the object
+  glm::vec3 _refractionDirection(Intersection &intersection, bool in, bool& newIn) const;
+
+  void _collectVisiblePoints(
+    glm::vec3 origin, glm::vec3 direction, unsigned int depth, glm::vec3 weight, bool in, uint32_t pixel,
+    std::vector<VisiblePoint>& points
+  ) const;
   
-  Color3f _computeRadianceWithPhotonMap(Intersection &intersection);
+  /// Light reflected by the intersection from the global map, through final gather if enabled
+  Color3f _indirectIllumination(Intersection &intersection) const;
+
+  /// Light reflected by the intersection from the caustics map
+  Color3f _causticIllumination(Intersection &intersection) const;
+
+  Color3f _computeRadianceWithPhotonMap(Intersection &intersection) const;
+
+  /// Indirect illumination of the intersection gathered with FINAL_GATHER_RAYS cosine distributed rays, traced
+  /// together, reading the global map at each hit. Much smoother than reading the map at the intersection itself,
+  /// especially with precomputed irradiance making each read a single lookup
+  Color3f _finalGather(Intersection &intersection) const;
+
+  /// Radiance reflected by the intersection estimated from the photons of the tree around it
+  /// - Parameters:
+  ///   - tree: photon map used for the estimate
+  ///   - intersection: shading point
+  ///   - maxRadius: farthest distance a photon is looked for
+  ///   - delta: width of the gaussian filter of the range estimate
+  Color3f _estimateRadiance(const PhotonKdTree& tree, Intersection &intersection, float maxRadius, float delta) const;
+
+  /// Irradiance arriving at the point estimated from the photons of the tree around it, the radiance estimate before
+  /// applying the color of the surface
+  /// - Parameters:
+  ///   - tree: photon map used for the estimate
+  ///   - position: point on the surface
+  ///   - normal: normal of the surface at the point
+  ///   - maxRadius: farthest distance a photon is looked for
+  ///   - delta: width of the gaussian filter of the range estimate
+  glm::vec3 _estimateIrradiance(
+    const PhotonKdTree& tree, glm::vec3 position, glm::vec3 normal, float maxRadius, float delta
+  ) const;
 
   std::shared_ptr<Scene> _scene;
-  std::shared_ptr<Kdtree::KdTree> _tree;
-  std::shared_ptr<Kdtree::KdTree> _caustics_tree;
+  std::shared_ptr<PhotonKdTree> _tree;
+  std::shared_ptr<PhotonKdTree> _caustics_tree;
+  /// Precomputed irradiance of the global map, stored as photons whose power is the irradiance. Null until
+  /// precomputeIrradiance is called
+  std::shared_ptr<PhotonKdTree> _irradiance_tree;
 };
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// Independent families of random streams. Keeping them apart means changing how many photons are shot does not
+/// change the numbers drawn while rendering and the other way around
+enum class SampleStream : uint32_t {
+  GlobalPhotons, CausticPhotons, Pixels
+};
+
+/// Pseudo random generator based on PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good
+/// Algorithms for Random Number Generation"). It keeps 16 bytes of state, so one can live in every thread and be
+/// reseeded for each unit of work without cost.
+class Sampler {
+public:
+  Sampler(uint64_t seed = 0, uint64_t stream = 0) {
+    reseed(seed, stream);
+  }
+
+  /// Restarts the sequence. Different streams with the same seed give independent sequences
+  /// - Parameters:
+  ///   - seed: seed shared by the whole run
+  ///   - stream: identifier of the sequence
+  void reseed(uint64_t seed, uint64_t stream) {
+    // Both values are scrambled so consecutive streams, which only differ in a few bits, do not start correlated
+    _increment = (_mix(stream) << 1u) | 1u;
+    _state = 0;
+    nextUInt();
+    _state += _mix(seed ^ _mix(stream + 0x9e3779b97f4a7c15ull));
+    nextUInt();
+  }
+
+  uint32_t nextUInt() {
+    auto state = _state;
+    _state = state * 6364136223846793005ull + _increment;
+
+    auto xorShifted = (uint32_t)(((state >> 18u) ^ state) >> 27u);
+    auto rotation = (uint32_t)(state >> 59u);
+    return (xorShifted >> rotation) | (xorShifted << ((0u - rotation) & 31u));
+  }
+
+  /// Uniform float in [0, 1)
+  float next01() {
+    // The top 24 bits fill the float mantissa exactly, so 1 is never returned
+    return (float)(nextUInt() >> 8) * (1.f / 16777216.f);
+  }
+
+  /// Fills values with uniform floats in [0, 1), the same numbers count calls to next01 would return
+  /// - Parameters:
+  ///   - values: destination of the samples
+  ///   - count: number of samples
+  void fill01(float* values, size_t count) {
+    auto state = _state;
+    auto increment = _increment;
+
+    // Working on local copies lets the compiler keep the state in registers for the whole batch
+    for (size_t i = 0; i < count; ++i) {
+      auto current = state;
+      state = state * 6364136223846793005ull + increment;
+
+      auto xorShifted = (uint32_t)(((current >> 18u) ^ current) >> 27u);
+      auto rotation = (uint32_t)(current >> 59u);
+      auto bits = (xorShifted >> rotation) | (xorShifted << ((0u - rotation) & 31u));
+      values[i] = (float)(bits >> 8) * (1.f / 16777216.f);
+    }
+
+    _state = state;
+  }
+
+private:
+  uint64_t _state = 0;
+  uint64_t _increment = 1;
+
+  /// SplitMix64 finalizer
+  static uint64_t _mix(uint64_t value) {
+    value = (value ^ (value >> 30u)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27u)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31u);
+  }
+};
+
+/// Sampler of the calling thread. Every thread owns one, so sampling never contends on shared state
+inline Sampler& threadSampler() {
+  thread_local Sampler sampler;
+  return sampler;
+}
+
+/// Restarts the sampler of the calling thread. Work seeded with the same values draws the same numbers no matter which
+/// thread runs it
+/// - Parameters:
+///   - seed: seed of the run, read from the scene file
+///   - stream: family of the unit of work
+///   - index: identifier of the unit of work inside its family
+inline void seedThreadSampler(uint64_t seed, SampleStream stream, uint64_t index) {
+  threadSampler().reseed(seed, ((uint64_t)stream << 48u) ^ index);
+}
@@ -1,15 +1,13 @@
 #include "Scene.hpp"
 
-Scene::Scene(RTCDevice device) {
+Scene::Scene(RTCDevice device, RenderSettings settings) : _settings(settings) {
+  _settings.validate();
+
   scene = rtcNewScene(device);
 }
 
 void Scene::addModel(std::shared_ptr<Model> model) {
   _models.push_back(model);
-
-  auto modelMaterialMap = model->getMaterialsMap();
-
-  _materials.insert(modelMaterialMap.begin(), modelMaterialMap.end());
 }
 
 void Scene::addTransparentBoundingBox(std::shared_ptr<BoundingBox> boundingBox) {
@@ -36,14 +34,20 @@ std::vector<std::shared_ptr<Light>> Scene::getLights() const {
 
 void Scene::commit() {
   for (auto model : _models) {
-    model->commit(scene);
+    model->commit(scene, _materials, _normalTransforms);
   }
   
   rtcCommitScene(scene);
 }
 
-Material Scene::getMaterial(unsigned int geometryId) {
-  return _materials[geometryId];
+BoundingBox Scene::getBounds() const {
+  RTCBounds bounds;
+  rtcGetSceneBounds(scene, &bounds);
+
+  return BoundingBox{
+    { bounds.lower_x, bounds.lower_y, bounds.lower_z },
+    { bounds.upper_x, bounds.upper_y, bounds.upper_z }
+  };
 }
 
 void Scene::setCamera(std::shared_ptr<Camera> camera) {
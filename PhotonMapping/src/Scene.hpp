@@ -1,7 +1,6 @@
 #pragma once
 
 #include <vector>
-#include <unordered_map>
 #include <memory>
 
 #include <embree3/rtcore.h>
@@ -10,13 +9,21 @@
 #include "Light.hpp"
 #include "Camera.hpp"
 #include "BoundingBox.hpp"
+#include "RenderSettings.hpp"
 
 /// Class representing scene with list of models
 class Scene {
 public:
   /// Initializes scene using device by generating an embree scene object
-  /// - Parameter device: device for object generation using embree
-  Scene(RTCDevice device);
+  /// - Parameters:
+  ///   - device: device for object generation using embree
+  ///   - settings: render parameters, validated and fixed for the lifetime of the scene
+  Scene(RTCDevice device, RenderSettings settings);
+
+  /// Returns the render parameters read from the scene file
+  const RenderSettings& getSettings() const {
+    return _settings;
+  }
   
   /// Adds model to the scene
   /// - Parameter model: Model to be added
@@ -40,8 +47,22 @@ public:
   /// Commits scene with models attached
   void commit();
 
-  /// Returns material for the geometry accessed
-  Material getMaterial(unsigned int geometryId);
+  /// Returns the box containing every model, only valid after commit
+  BoundingBox getBounds() const;
+
+  /// Returns material for the geometry accessed, a single array read. Only valid after commit
+  /// - Parameter geometryId: id of the geometry hit, as reported by Embree. For hits inside an instance, the instance
+  ///   id, since every mesh of an instance shares its material
+  const Material& getMaterial(unsigned int geometryId) const {
+    return _materials[geometryId];
+  }
+
+  /// Returns the matrix taking the normal of a hit to world space, only valid after commit. Hits inside an instance
+  /// report their normal in the space of the instanced model
+  /// - Parameter geometryId: id of the geometry hit in the scene, the instance id for hits inside an instance
+  const glm::mat3& getNormalTransform(unsigned int geometryId) const {
+    return _normalTransforms[geometryId];
+  }
 
   /// Sets camera that will be used for the scene
   /// - Parameter camera: shared pointer to camera
@@ -55,8 +76,12 @@ public:
 
   ~Scene();
 private:
+  const RenderSettings _settings;
   std::vector<std::shared_ptr<Model>> _models;
-  std::unordered_map<unsigned int, Material> _materials;
+  /// Material of each geometry indexed by the id Embree gave it when attached
+  std::vector<Material> _materials;
+  /// Normal transform of each geometry indexed like the materials
+  std::vector<glm::mat3> _normalTransforms;
   std::vector<std::shared_ptr<Light>> _lights;
   std::shared_ptr<Camera> _camera;
   std::vector<std::shared_ptr<BoundingBox>> _transparentBoundingBoxes;
@@ -1,7 +1,11 @@
 #include "SceneBuilder.hpp"
 
+#include <chrono>
+#include <functional>
 #include <iostream>
 
+#include "Parallel.hpp"
+
 namespace YAML {
   template<>
   struct convert<glm::vec3> {
@@ -85,7 +89,7 @@ namespace YAML {
 SceneBuilder::SceneBuilder(RTCDevice device) : _device(device) {
 }
 
-void SceneBuilder::_addSphere(YAML::Node node) {
+std::function<std::shared_ptr<Model>()> SceneBuilder::_addSphere(YAML::Node node) {
   auto material = node["material"].as<Material>();
   auto center = node["center"].as<glm::vec3>();
   auto radius = node["radius"].as<float>();
@@ -97,33 +101,98 @@ void SceneBuilder::_addSphere(YAML::Node node) {
   // std::cout << "Bounding box (min): (" << boundingBox.min.x << ", " << boundingBox.min.y << ", " << boundingBox.min.z << ")" << std::endl;
   // std::cout << "Bounding box (max): (" << boundingBox.max.x << ", " << boundingBox.max.y << ", " << boundingBox.max.z << ")" << std::endl;
   
-  auto sphere = std::make_shared<Model>(
-    RTC_GEOMETRY_TYPE_SPHERE_POINT,
-    material,
-    _device,
-    glm::vec4(center, radius)
-  );
-  _scene->addModel(sphere);
   _scene->addTransparentBoundingBox(boundingBox);
+
+  auto device = _device;
+  return [=]() {
+    return std::make_shared<Model>(
+      RTC_GEOMETRY_TYPE_SPHERE_POINT,
+      material,
+      device,
+      glm::vec4(center, radius)
+    );
+  };
 }
 
-void SceneBuilder::_addFileModel(YAML::Node node) {
+std::function<std::shared_ptr<Model>()> SceneBuilder::_addFileModel(YAML::Node node) {
     auto material = node["material"].as<Material>();
-    auto model = std::make_shared<Model>(node["path"].as<std::string>(), material, _device);
-    _scene->addModel(model);
+    auto path = node["path"].as<std::string>();
+    auto device = _device;
+    return [=]() {
+      return std::make_shared<Model>(path, material, device);
+    };
+}
+
+std::function<std::shared_ptr<Model>()> SceneBuilder::_addInstance(YAML::Node node) {
+  auto material = node["material"].as<Material>();
+  auto path = node["path"].as<std::string>();
+  auto position = node["position"] ? node["position"].as<glm::vec3>() : glm::vec3{ 0.f };
+  auto rotation = node["rotation"] ? node["rotation"].as<glm::vec3>() : glm::vec3{ 0.f };
+  auto scale = node["scale"] ? node["scale"].as<glm::vec3>() : glm::vec3{ 1.f };
+
+  // Scaled, then rotated around x, y and z in degrees, then moved to the position
+  auto transform = glm::translate(glm::mat4{ 1.f }, position);
+  transform = glm::rotate(transform, glm::radians(rotation.z), glm::vec3{ 0.f, 0.f, 1.f });
+  transform = glm::rotate(transform, glm::radians(rotation.y), glm::vec3{ 0.f, 1.f, 0.f });
+  transform = glm::rotate(transform, glm::radians(rotation.x), glm::vec3{ 1.f, 0.f, 0.f });
+  transform = glm::scale(transform, scale);
+
+  // Every instance of a path shares one prototype, loaded before the instances are created
+  _prototypes.emplace(path, nullptr);
+
+  auto device = _device;
+  return [=, this]() {
+    return std::make_shared<Model>(_prototypes.at(path), material, device, transform);
+  };
 }
 
 void SceneBuilder::_loadModels(YAML::Node models) {
+  typedef std::chrono::high_resolution_clock Time;
+  auto start = Time::now();
+
+  // The scene file is read up front on this thread, yaml nodes can not be read from several threads at once
+  std::vector<std::function<std::shared_ptr<Model>()>> loaders;
   for (std::size_t i = 0; i < models.size(); i++) {
     if (models[i]["type"].as<std::string>() == "sphere") {
       std::cout << "SPHERE LOADED" << std::endl;
-      _addSphere(models[i]);
+      loaders.push_back(_addSphere(models[i]));
     } else if (models[i]["type"].as<std::string>() == "fileModel") {
       std::cout << "MODEL LOADED" << std::endl;
-      _addFileModel(models[i]);
+      loaders.push_back(_addFileModel(models[i]));
+    } else if (models[i]["type"].as<std::string>() == "instance") {
+      std::cout << "INSTANCE LOADED" << std::endl;
+      loaders.push_back(_addInstance(models[i]));
     }
   }
 
+  std::vector<std::string> prototypePaths;
+  for (const auto& prototype : _prototypes) {
+    prototypePaths.push_back(prototype.first);
+  }
+
+  // Prototypes are loaded first, instances only read them afterwards
+  std::vector<std::shared_ptr<ModelPrototype>> loadedPrototypes(prototypePaths.size());
+  parallelFor(prototypePaths.size(), [&](size_t i) {
+    loadedPrototypes[i] = std::make_shared<ModelPrototype>(prototypePaths[i], _device);
+  });
+  for (size_t i = 0; i < prototypePaths.size(); i++) {
+    _prototypes[prototypePaths[i]] = loadedPrototypes[i];
+  }
+
+  // Each model is imported with its own importer and creates its own geometries, so they load in parallel
+  std::vector<std::shared_ptr<Model>> loadedModels(loaders.size());
+  parallelFor(loaders.size(), [&](size_t i) {
+    loadedModels[i] = loaders[i]();
+  });
+
+  // Added in file order, so geometry ids do not depend on which model finished loading first
+  for (const auto& model : loadedModels) {
+    _scene->addModel(model);
+  }
+
+  auto loadTime = std::chrono::duration_cast<std::chrono::milliseconds>(Time::now() - start);
+  std::cout << "Loaded " << loadedModels.size() << " models and " << _prototypes.size() << " instanced files in "
+    << loadTime.count() << "ms" << std::endl;
 }
 
 void SceneBuilder::_loadLights(YAML::Node lights) {
@@ -142,6 +211,7 @@ void SceneBuilder::_loadLights(YAML::Node lights) {
         lights[i]["vvec"].as<glm::vec3>(),
         lights[i]["usteps"].as<size_t>(),
         lights[i]["vsteps"].as<size_t>(),
+        _scene->getSettings().epsilon,
         _device
       );
     } else if (lights[i]["type"].as<std::string>() == "pointLight") {
@@ -154,49 +224,68 @@ void SceneBuilder::_loadLights(YAML::Node lights) {
   }
 }
 
-void SceneBuilder::_loadConstants(YAML::Node constants) {
-  if (!constants[EPSILON] ||
-      !constants[MAX_PHOTON_SAMPLING_DISTANCE] ||
-      !constants[DELTA] ||
-      !constants[TOTAL_LIGHT] ||
-      !constants[MAX_DEPTH] ||
-      !constants[PHOTONS_PER_SAMPLE] ||
-      !constants[PHOTON_LIMIT] ||
-      !constants[SHOULD_PRINT_CAUSTICS_HIT_PHOTON_MAP] ||
-      !constants[SHOULD_PRINT_DEPTH_PHOTON_MAP] ||
-      !constants[SHOULD_PRINT_HIT_PHOTON_MAP] ||
-      !constants[LOAD_TREE] ||
-      !constants[GAMMA_CORRECTION]) {
-      throw("MISSING CONSTANTS");
+/// Overwrites the setting with the constant of the scene file if it is present, keeping the default otherwise
+template<typename T>
+static void loadSetting(const YAML::Node& constants, const char* name, T& setting) {
+  if (constants[name]) {
+    setting = constants[name].as<T>();
+  }
+
+  std::cout << name << ": " << setting << std::endl;
+}
+
+RenderSettings SceneBuilder::_loadConstants(YAML::Node constants) {
+  RenderSettings settings;
+
+  loadSetting(constants, "WIDTH", settings.width);
+  loadSetting(constants, "HEIGHT", settings.height);
+  loadSetting(constants, "MAX_DEPTH", settings.maxDepth);
+  loadSetting(constants, "MAX_PHOTON_DEPTH", settings.maxPhotonDepth);
+  loadSetting(constants, "PHOTONS_PER_SAMPLE", settings.photonsPerSample);
+  loadSetting(constants, "PHOTON_LIMIT", settings.photonLimit);
+  loadSetting(constants, "EPSILON", settings.epsilon);
+  loadSetting(constants, "MAX_PHOTON_SAMPLING_DISTANCE", settings.maxPhotonSamplingDistance);
+  loadSetting(constants, "DELTA", settings.delta);
+  loadSetting(constants, "TOTAL_LIGHT", settings.totalLight);
+  loadSetting(constants, "GAMMA_CORRECTION", settings.gammaCorrection);
+  loadSetting(constants, "SHOULD_PRINT_CAUSTICS_HIT_PHOTON_MAP", settings.shouldPrintCausticsHitPhotonMap);
+  loadSetting(constants, "SHOULD_PRINT_DEPTH_PHOTON_MAP", settings.shouldPrintDepthPhotonMap);
+  loadSetting(constants, "SHOULD_PRINT_HIT_PHOTON_MAP", settings.shouldPrintHitPhotonMap);
+  loadSetting(constants, "LOAD_TREE", settings.loadTree);
+  loadSetting(constants, "COMPACT_PHOTONS", settings.compactPhotons);
+  loadSetting(constants, "PRECOMPUTE_IRRADIANCE", settings.precomputeIrradiance);
+  loadSetting(constants, "FINAL_GATHER_RAYS", settings.finalGatherRays);
+  loadSetting(constants, "PROGRESSIVE_PASSES", settings.progressivePasses);
+  loadSetting(constants, "SEED", settings.seed);
+  loadSetting(constants, "WAVEFRONT", settings.wavefront);
+
+  if (constants["RADIANCE_ESTIMATE"]) {
+    auto estimate = constants["RADIANCE_ESTIMATE"].as<std::string>();
+
+    if (estimate == "range") {
+      settings.radianceEstimate = RadianceEstimate::Range;
+    } else if (estimate == "nearest") {
+      settings.radianceEstimate = RadianceEstimate::Nearest;
+    } else {
+      throw("Wrong radiance estimate");
+    }
   }
-  std::cout << WIDTH << ": " << constants[WIDTH] << std::endl;
-  std::cout << HEIGHT << ": " << constants[HEIGHT] << std::endl;
-  std::cout << MAX_PHOTON_SAMPLING_DISTANCE << ": " << constants[MAX_PHOTON_SAMPLING_DISTANCE] << std::endl;
-  std::cout << DELTA << ": " << constants[DELTA] << std::endl;
-  std::cout << TOTAL_LIGHT << ": " << constants[TOTAL_LIGHT] << std::endl;
-  std::cout << MAX_DEPTH << ": " << constants[MAX_DEPTH] << std::endl;
-  std::cout << PHOTONS_PER_SAMPLE << ": " << constants[PHOTONS_PER_SAMPLE] << std::endl;
-  std::cout << PHOTON_LIMIT << ": " << constants[PHOTON_LIMIT] << std::endl;
-  std::cout << SHOULD_PRINT_CAUSTICS_HIT_PHOTON_MAP << ": " << constants[SHOULD_PRINT_CAUSTICS_HIT_PHOTON_MAP] << std::endl;
-  std::cout << SHOULD_PRINT_DEPTH_PHOTON_MAP << ": " << constants[SHOULD_PRINT_DEPTH_PHOTON_MAP] << std::endl;
-  std::cout << SHOULD_PRINT_HIT_PHOTON_MAP << ": " << constants[SHOULD_PRINT_HIT_PHOTON_MAP] << std::endl;
-
-  INT_CONSTANTS[WIDTH] = constants[WIDTH].as<int>();
-  INT_CONSTANTS[HEIGHT] = constants[HEIGHT].as<int>();
-  INT_CONSTANTS[MAX_DEPTH] = constants[MAX_DEPTH].as<int>();
-  INT_CONSTANTS[PHOTONS_PER_SAMPLE] = constants[PHOTONS_PER_SAMPLE].as<int>();
-  INT_CONSTANTS[PHOTON_LIMIT] = constants[PHOTON_LIMIT].as<int>();
-
-  FLOAT_CONSTANTS[EPSILON] = constants[EPSILON].as<float>();
-  FLOAT_CONSTANTS[MAX_PHOTON_SAMPLING_DISTANCE] = constants[MAX_PHOTON_SAMPLING_DISTANCE].as<float>();
-  FLOAT_CONSTANTS[DELTA] = constants[DELTA].as<float>();
-  FLOAT_CONSTANTS[TOTAL_LIGHT] = constants[TOTAL_LIGHT].as<float>();
-  FLOAT_CONSTANTS[GAMMA_CORRECTION] = constants[GAMMA_CORRECTION].as<float>();
-
-  BOOL_CONSTANTS[SHOULD_PRINT_CAUSTICS_HIT_PHOTON_MAP] = constants[SHOULD_PRINT_CAUSTICS_HIT_PHOTON_MAP].as<bool>();
-  BOOL_CONSTANTS[SHOULD_PRINT_DEPTH_PHOTON_MAP] = constants[SHOULD_PRINT_DEPTH_PHOTON_MAP].as<bool>();
-  BOOL_CONSTANTS[SHOULD_PRINT_HIT_PHOTON_MAP] = constants[SHOULD_PRINT_HIT_PHOTON_MAP].as<bool>();
-  BOOL_CONSTANTS[LOAD_TREE] = constants[LOAD_TREE].as<bool>();
+  std::cout << "RADIANCE_ESTIMATE: " << (settings.radianceEstimate == RadianceEstimate::Nearest ? "nearest" : "range") << std::endl;
+
+  if (constants["PROGRESSIVE_GATHER"]) {
+    auto gather = constants["PROGRESSIVE_GATHER"].as<std::string>();
+
+    if (gather == "tree") {
+      settings.progressiveGather = ProgressiveGather::Tree;
+    } else if (gather == "grid") {
+      settings.progressiveGather = ProgressiveGather::Grid;
+    } else {
+      throw("Wrong progressive gather");
+    }
+  }
+  std::cout << "PROGRESSIVE_GATHER: " << (settings.progressiveGather == ProgressiveGather::Grid ? "grid" : "tree") << std::endl;
+
+  return settings;
 }
 
 std::shared_ptr<Scene> SceneBuilder::createScene() {
@@ -205,15 +294,15 @@ std::shared_ptr<Scene> SceneBuilder::createScene() {
   if (!_file["models"] || !_file["lights"] || !_file["constants"] || !_file["materials"]) {
       throw("MISSING STUFF");
   }
-  _scene = std::make_shared<Scene>(_device);
+  _scene = std::make_shared<Scene>(_device, _loadConstants(_file["constants"]));
 
-  _loadConstants(_file["constants"]);
   _loadModels(_file["models"]);
   _loadLights(_file["lights"]);
 
   _scene->commit();
 
-  auto camera = std::make_shared<Camera>(INT_CONSTANTS[WIDTH] / INT_CONSTANTS[HEIGHT], 1.f);
+  const auto& settings = _scene->getSettings();
+  auto camera = std::make_shared<Camera>(settings.width / settings.height, 1.f);
   _scene->setCamera(camera);
 
   return _scene;
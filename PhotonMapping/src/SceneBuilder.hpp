@@ -1,8 +1,12 @@
+#include <functional>
+#include <map>
+
 #include <yaml-cpp/yaml.h>
 #include "Scene.hpp"
 #include "Camera.hpp"
 #include "Model.hpp"
 #include "BoundingBox.hpp"
+#include "RenderSettings.hpp"
 
 class SceneBuilder {
 public:
@@ -13,11 +17,22 @@ private:
   float _aspectRatio;
 	YAML::Node _file;
 	std::vector<std::shared_ptr<Model>> _models;
+  /// Model file of every instance path, shared by all its instances
+  std::map<std::string, std::shared_ptr<ModelPrototype>> _prototypes;
   std::shared_ptr<Scene> _scene;
 
   void _loadModels(YAML::Node models);
   void _loadLights(YAML::Node lights);
-  void _loadConstants(YAML::Node constants);
-  void _addSphere(YAML::Node node);
-  void _addFileModel(YAML::Node node);
+  RenderSettings _loadConstants(YAML::Node constants);
+
+  /// Reads a sphere from the scene file and returns the task creating its model, so models can be created in parallel
+  std::function<std::shared_ptr<Model>()> _addSphere(YAML::Node node);
+
+  /// Reads a model file entry from the scene file and returns the task importing it, so files can be imported in
+  /// parallel
+  std::function<std::shared_ptr<Model>()> _addFileModel(YAML::Node node);
+
+  /// Reads an instance from the scene file and returns the task creating it. The task must run after the prototype
+  /// of its path is loaded
+  std::function<std::shared_ptr<Model>()> _addInstance(YAML::Node node);
 };
\ No newline at end of file
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
 #include <embree3/rtcore.h>
 #include <glm/glm.hpp>
 
 #include "Vector.hpp"
 #include "Light.hpp"
 #include "Constants.hpp"
+#include "Sampler.hpp"
 
-inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction, float tfar) {
+inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction, float tnear, float tfar) {
   struct RTCRayHit shadowRayHit;
 
   shadowRayHit.ray.org_x = origin.x;
@@ -18,7 +23,7 @@ inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction, float tfar) {
   shadowRayHit.ray.dir_y = direction.y;
   shadowRayHit.ray.dir_z = direction.z;
 
-  shadowRayHit.ray.tnear = FLOAT_CONSTANTS[EPSILON];
+  shadowRayHit.ray.tnear = tnear;
   shadowRayHit.ray.tfar = tfar;
 
   shadowRayHit.ray.mask = -1;
@@ -30,7 +35,7 @@ inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction, float tfar) {
   return shadowRayHit;
 }
 
-inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction) {
+inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction, float tnear) {
   struct RTCRayHit shadowRayHit;
 
   shadowRayHit.ray.org_x = origin.x;
@@ -41,7 +46,7 @@ inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction) {
   shadowRayHit.ray.dir_y = direction.y;
   shadowRayHit.ray.dir_z = direction.z;
 
-  shadowRayHit.ray.tnear = FLOAT_CONSTANTS[EPSILON];
+  shadowRayHit.ray.tnear = tnear;
   shadowRayHit.ray.tfar = std::numeric_limits<float>::infinity();
 
   shadowRayHit.ray.mask = -1;
@@ -53,7 +58,7 @@ inline auto rtcRayFrom(glm::vec3 origin, glm::vec3 direction) {
   return shadowRayHit;
 }
 
-inline auto rtcRayFrom(Vector vector) {
+inline auto rtcRayFrom(Vector vector, float tnear) {
   struct RTCRayHit shadowRayHit;
 
   shadowRayHit.ray.org_x = vector.ox;
@@ -64,7 +69,7 @@ inline auto rtcRayFrom(Vector vector) {
   shadowRayHit.ray.dir_y = vector.dy;
   shadowRayHit.ray.dir_z = vector.dz;
 
-  shadowRayHit.ray.tnear = FLOAT_CONSTANTS[EPSILON];
+  shadowRayHit.ray.tnear = tnear;
   shadowRayHit.ray.tfar = std::numeric_limits<float>::infinity();
 
   shadowRayHit.ray.mask = -1;
@@ -85,7 +90,7 @@ inline float maxComponent(float first, float second, float third) {
 }
 
 inline float rand01() {
-  return (static_cast <float> (rand()) / static_cast <float> (RAND_MAX));
+  return threadSampler().next01();
 }
 
 inline float rand11() {
@@ -95,3 +100,27 @@ inline float rand11() {
 inline float generalRand(float min, float max) {
   return rand01() * (max - min) + min;
 }
+
+/// Random index in [0, count), count must be greater than zero
+inline size_t randomIndex(size_t count) {
+  return std::min((size_t)(rand01() * (float)count), count - 1);
+}
+
+/// Direction in the hemisphere around the normal with density proportional to the cosine with the normal
+/// - Parameters:
+///   - normal: normalized axis of the hemisphere
+///   - u: uniform random number in [0, 1)
+///   - v: uniform random number in [0, 1)
+inline glm::vec3 cosineSampleHemisphere(glm::vec3 normal, float u, float v) {
+  // Orthonormal basis without branches or normalization, from Duff et al. 2017
+  auto sign = std::copysign(1.f, normal.z);
+  auto a = -1.f / (sign + normal.z);
+  auto b = normal.x * normal.y * a;
+  glm::vec3 tangent{ 1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x };
+  glm::vec3 bitangent{ b, sign + normal.y * normal.y * a, -normal.y };
+
+  auto radius = std::sqrt(u);
+  auto angle = 2.f * PI * v;
+
+  return radius * std::cos(angle) * tangent + radius * std::sin(angle) * bitangent + std::sqrt(1.f - u) * normal;
+}
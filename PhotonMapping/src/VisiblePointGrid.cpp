@@ -0,0 +1,96 @@
+#include "VisiblePointGrid.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "Parallel.hpp"
+
+/// Points registered by each task of the build
+constexpr size_t gridChunkSize = 4096;
+
+/// Calls visit(cell) for every cell touched by the box of the sphere
+template<typename Visit>
+static void forEachCell(glm::ivec3 min, glm::ivec3 max, Visit&& visit) {
+  for (auto x = min.x; x <= max.x; ++x) {
+    for (auto y = min.y; y <= max.y; ++y) {
+      for (auto z = min.z; z <= max.z; ++z) {
+        visit(glm::ivec3{ x, y, z });
+      }
+    }
+  }
+}
+
+static uint32_t nextPowerOfTwo(uint64_t value) {
+  uint64_t power = 1;
+  while (power < value && power < (1ull << 31)) {
+    power <<= 1;
+  }
+  return (uint32_t)power;
+}
+
+VisiblePointGrid::VisiblePointGrid(
+  const std::vector<glm::vec3>& positions, float radius, const BoundingBox& sceneBounds
+) :
+  _origin(sceneBounds.min),
+  _inverseCellSize(1.f / (2.f * radius)) {
+  // With cells as large as the search diameter every sphere touches at most 8 of them. The table has about two
+  // buckets per registration, but never more than the cells needed to cover the scene
+  auto sceneCells = glm::dvec3(glm::ceil((sceneBounds.max - sceneBounds.min) * _inverseCellSize)) + 1.0;
+  auto bucketCount = std::max(1u, std::min(
+    nextPowerOfTwo(16 * (uint64_t)positions.size()),
+    nextPowerOfTwo((uint64_t)std::min(sceneCells.x * sceneCells.y * sceneCells.z, 4294967296.0))
+  ));
+  _bucketMask = bucketCount - 1;
+
+  auto chunkCount = (positions.size() + gridChunkSize - 1) / gridChunkSize;
+  auto forEachRegistration = [&](size_t chunk, auto&& registerPoint) {
+    auto last = std::min(positions.size(), (chunk + 1) * gridChunkSize);
+    for (size_t point = chunk * gridChunkSize; point < last; ++point) {
+      auto min = _cell(positions[point] - radius);
+      auto max = _cell(positions[point] + radius);
+      forEachCell(min, max, [&](glm::ivec3 cell) {
+        registerPoint((uint32_t)point, _bucket(cell));
+      });
+    }
+  };
+
+  // Counting sort without locks: the buckets are counted with atomic increments, their starts are the prefix sum of
+  // the counts, and each registration claims its slot with another atomic increment
+  auto counts = std::make_unique<std::atomic<uint32_t>[]>(bucketCount);
+  for (uint32_t bucket = 0; bucket < bucketCount; ++bucket) {
+    counts[bucket].store(0, std::memory_order_relaxed);
+  }
+
+  parallelFor(chunkCount, [&](size_t chunk) {
+    forEachRegistration(chunk, [&](uint32_t, uint32_t bucket) {
+      counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    });
+  });
+
+  _bucketStarts.resize((size_t)bucketCount + 1);
+  _bucketStarts[0] = 0;
+  for (uint32_t bucket = 0; bucket < bucketCount; ++bucket) {
+    _bucketStarts[bucket + 1] = _bucketStarts[bucket] + counts[bucket].load(std::memory_order_relaxed);
+    counts[bucket].store(_bucketStarts[bucket], std::memory_order_relaxed);
+  }
+
+  _bucketPoints.resize(_bucketStarts[bucketCount]);
+  parallelFor(chunkCount, [&](size_t chunk) {
+    forEachRegistration(chunk, [&](uint32_t point, uint32_t bucket) {
+      _bucketPoints[counts[bucket].fetch_add(1, std::memory_order_relaxed)] = point;
+    });
+  });
+
+  // Threads fill the buckets in any order, sorting them keeps the order of the visits independent of the threads
+  parallelFor((bucketCount + gridChunkSize - 1) / gridChunkSize, [&](size_t chunk) {
+    auto last = std::min<size_t>(bucketCount, (chunk + 1) * gridChunkSize);
+    for (size_t bucket = chunk * gridChunkSize; bucket < last; ++bucket) {
+      std::sort(_bucketPoints.begin() + _bucketStarts[bucket], _bucketPoints.begin() + _bucketStarts[bucket + 1]);
+    }
+  });
+}
+
+size_t VisiblePointGrid::bucketCount() const {
+  return (size_t)_bucketMask + 1;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "BoundingBox.hpp"
+
+/// Spatial hash grid over a fixed set of points, each registered in every cell its search sphere touches, so the
+/// points that may contain a photon are found by reading the single cell of the photon instead of searching a tree.
+/// The grid is built without locks and is read-only afterwards, so any number of threads can query it at once
+class VisiblePointGrid {
+public:
+  /// Builds the grid in parallel
+  /// - Parameters:
+  ///   - positions: positions of the points
+  ///   - radius: largest search radius of any point, the cells are twice as large
+  ///   - sceneBounds: box containing every point, used as origin of the cells and to limit the size of the table
+  VisiblePointGrid(const std::vector<glm::vec3>& positions, float radius, const BoundingBox& sceneBounds);
+
+  /// Calls visitor(index) for every point whose search sphere may contain the position. Points of other cells that
+  /// share the hash bucket are visited too, so the visitor must check the distance
+  /// - Parameters:
+  ///   - position: position of the photon
+  ///   - visitor: callable receiving the index of each point
+  template<typename Visitor>
+  void forEachCandidate(glm::vec3 position, Visitor&& visitor) const;
+
+  /// Number of buckets of the hash table
+  size_t bucketCount() const;
+
+private:
+  glm::vec3 _origin;
+  float _inverseCellSize;
+  uint32_t _bucketMask;
+  /// Points of bucket i are _bucketPoints[_bucketStarts[i]] to _bucketPoints[_bucketStarts[i + 1] - 1]
+  std::vector<uint32_t> _bucketStarts;
+  std::vector<uint32_t> _bucketPoints;
+
+  glm::ivec3 _cell(glm::vec3 position) const;
+
+  uint32_t _bucket(glm::ivec3 cell) const;
+};
+
+inline glm::ivec3 VisiblePointGrid::_cell(glm::vec3 position) const {
+  return glm::ivec3(glm::floor((position - _origin) * _inverseCellSize));
+}
+
+inline uint32_t VisiblePointGrid::_bucket(glm::ivec3 cell) const {
+  // Teschner et al. 2003, the primes spread neighbouring cells over the whole table
+  auto hash = ((uint32_t)cell.x * 73856093u) ^ ((uint32_t)cell.y * 19349663u) ^ ((uint32_t)cell.z * 83492791u);
+  return hash & _bucketMask;
+}
+
+template<typename Visitor>
+void VisiblePointGrid::forEachCandidate(glm::vec3 position, Visitor&& visitor) const {
+  auto bucket = _bucket(_cell(position));
+
+  // A point touching two cells that share the bucket is registered twice, buckets are sorted so it is skipped here
+  auto previous = UINT32_MAX;
+  for (auto point = _bucketStarts[bucket]; point < _bucketStarts[bucket + 1]; ++point) {
+    if (_bucketPoints[point] != previous) {
+      previous = _bucketPoints[point];
+      visitor(previous);
+    }
+  }
+}
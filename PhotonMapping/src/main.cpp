@@ -15,11 +15,15 @@
 #include "Renderer.hpp"
 #include "PhotonMapper.hpp"
 #include "SceneBuilder.hpp"
+#include "Parallel.hpp"
+#include "PhotonKernels.hpp"
+#include "ProgressiveEstimate.hpp"
 
 #include "Utils.hpp"
 
 constexpr auto photonsTreeFilename = "photonsTree";
 constexpr auto causticsTreeFilename = "causticsTree";
+constexpr unsigned int tileSize = 16;
 
 void errorFunction(void* userPtr, enum RTCError error, const char* str)
 {
@@ -43,17 +47,19 @@ int main()
   typedef std::chrono::milliseconds ms;
   typedef std::chrono::duration<float> fsec;
   auto t0 = Time::now();
-  std::srand(time(0));
   RTCDevice device = initializeDevice();
   auto maskEnabled = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_RAY_MASK_SUPPORTED);
   std::cout << "Mask property enabled: " << maskEnabled << std::endl;
+  std::cout << "Photon gather kernel: " << photonLeafKernelName() << std::endl;
   SceneBuilder sceneBuilder = SceneBuilder(device);
   std::shared_ptr<Scene> scene = sceneBuilder.createScene();
 
-  auto image = new Image(INT_CONSTANTS[WIDTH], INT_CONSTANTS[HEIGHT]);
-  auto globalPMImage = new Image(INT_CONSTANTS[WIDTH], INT_CONSTANTS[HEIGHT]);
-  auto directImage = new Image(INT_CONSTANTS[WIDTH], INT_CONSTANTS[HEIGHT]);
-  auto causticsImage = new Image(INT_CONSTANTS[WIDTH], INT_CONSTANTS[HEIGHT]);
+  const auto& settings = scene->getSettings();
+
+  auto image = new Image(settings.width, settings.height, settings.gammaCorrection);
+  auto globalPMImage = new Image(settings.width, settings.height, settings.gammaCorrection);
+  auto directImage = new Image(settings.width, settings.height, settings.gammaCorrection);
+  auto causticsImage = new Image(settings.width, settings.height, settings.gammaCorrection);
   const auto aspectRatio = (float)image->width / (float)image->height;
   auto camera = std::make_shared<Camera>(aspectRatio, 1.f);
 
@@ -66,12 +72,14 @@ int main()
 
   photonMapper.useScene(scene);
 
-  if (BOOL_CONSTANTS[LOAD_TREE]) {
+  if (settings.progressivePasses > 0) {
+    // The global map is replaced by batches of photons added progressively after rendering
+    photonMapper.makeCausticsPhotonMap(PhotonMap::Caustics);
+  } else if (settings.loadTree) {
     std::cout << "CARGANDO VIEJA" << std::endl;
     photonMapper.initializeTreeFromFile(photonsTreeFilename, causticsTreeFilename);
   } else {
-    photonMapper.makeGlobalPhotonMap(PhotonMap::Global);
-    photonMapper.makeCausticsPhotonMap(PhotonMap::Global);
+    photonMapper.makePhotonMaps();
 
     photonMapper.saveTreeToFile(photonsTreeFilename, causticsTreeFilename);
   }
@@ -81,15 +89,67 @@ int main()
   renderer.setTree(photonMapper.getTree());
   renderer.setCausticsTree(photonMapper.getCausticsTree());
 
-  for (unsigned int x = 0; x < image->width; ++x) {
-    for (unsigned int y = 0; y < image->height; ++y) {
-      Color3f pmColor[3] = {glm::vec3(0.f), glm::vec3(0.f), glm::vec3(0.f)};
-      Color3f color = renderer.renderPixel(x, y, image->width, image->height, pmColor);
+  if (settings.precomputeIrradiance && photonMapper.getTree()) {
+    renderer.precomputeIrradiance();
+  }
+
+  auto tiles = makeTiles(image->width, image->height, tileSize);
+  std::vector<Color3f> colors((size_t)image->width * image->height);
+
+  auto writePixel = [&](uint_fast32_t x, uint_fast32_t y, Color3f color, const Color3f* pmColor) {
+    colors[y * image->width + x] = color;
+    image->writePixel(x, y, color);
+    globalPMImage->writePixel(x, y, pmColor[0]);
+    causticsImage->writePixel(x, y, pmColor[1]);
+    directImage->writePixel(x, y, pmColor[2]);
+  };
+
+  parallelFor(tiles.size(), [&](size_t tileIndex) {
+    if (settings.wavefront) {
+      renderer.renderTileWavefront(tiles[tileIndex], image->width, image->height, writePixel);
+    } else {
+      renderer.renderTile(tiles[tileIndex], image->width, image->height, writePixel);
+    }
+  });
+
+  if (settings.progressivePasses > 0) {
+    ProgressiveEstimate estimate(
+      renderer.collectVisiblePoints(image->width, image->height), settings.maxPhotonSamplingDistance
+    );
+    std::cout << "Collected " << estimate.size() << " visible points" << std::endl;
+
+    if (settings.progressiveGather == ProgressiveGather::Grid) {
+      estimate.enableSplatting(scene->getBounds());
+    }
 
-      image->writePixel(x, y, color);
-      globalPMImage->writePixel(x, y, pmColor[0]);
-      causticsImage->writePixel(x, y, pmColor[1]);
-      directImage->writePixel(x, y, pmColor[2]);
+    // The images are saved after every pass, so the render can be stopped once it looks converged
+    for (unsigned int pass = 0; pass < settings.progressivePasses; ++pass) {
+      auto passStart = Time::now();
+
+      if (settings.progressiveGather == ProgressiveGather::Grid) {
+        photonMapper.splatGlobalPhotonBatch(pass, estimate);
+        estimate.addSplattedPhotons();
+      } else {
+        estimate.addPhotons(*photonMapper.makeGlobalPhotonBatch(pass));
+      }
+
+      ms passTime = std::chrono::duration_cast<ms>(Time::now() - passStart);
+      std::cout << "Gathered progressive pass " << pass + 1 << " in " << passTime.count() << "ms" << std::endl;
+
+      std::vector<Color3f> indirect(colors.size(), Color3f{ 0.f });
+      estimate.addRadiance(indirect);
+
+      for (uint32_t y = 0; y < image->height; ++y) {
+        for (uint32_t x = 0; x < image->width; ++x) {
+          auto pixel = y * image->width + x;
+          image->writePixel(x, y, colors[pixel] + indirect[pixel]);
+          globalPMImage->writePixel(x, y, indirect[pixel]);
+        }
+      }
+
+      image->save("final.png");
+      globalPMImage->save("globalPM.png");
+      std::cout << "Progressive pass " << pass + 1 << "/" << settings.progressivePasses << std::endl;
     }
   }
 
@@ -48,6 +48,7 @@ project "PhotonMapping"
   end
 
   if os.host() == "linux" then
+    links { "pthread" }
     postbuildcommands "{COPYFILE} %{wks.location}/../%{prj.name}/vendor/libraries/%{cfg.system}/*.so* %{cfg.targetdir}"
     postbuildcommands "{COPY} %{wks.location}/../%{prj.name}/assets %{cfg.targetdir}/"
   end